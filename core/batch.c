@@ -0,0 +1,265 @@
+#include "batch.h"
+#include "koei.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/**
+ * every worker owns a deque of jobs, pops from its bottom and steals from the top of the others'.
+ * jobs are dealt largest first, so the long ones start early and the short ones fill the gaps.
+ */
+
+typedef struct deque_t {
+	pthread_mutex_t lock;
+	u32 *jobs;
+	u32 top, bottom; // [top, bottom)
+} deque_t;
+
+typedef struct worker_t {
+	struct pool_t *pool;
+	u32 id;
+	deque_t deque;
+	u32 steals;
+	// scratch
+	u8 *raw, *packed;
+	u32 raw_cap, packed_cap;
+	huff_work_t huff;
+} worker_t;
+
+typedef struct pool_t {
+	batch_job_t *jobs;
+	worker_t *workers;
+	u32 num_workers;
+} pool_t;
+
+static double now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+u32 batch_num_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+static bool reserve(u8 **buf, u32 *cap, u32 size)
+{
+	if (size <= *cap)
+		return true;
+	u8 *p = realloc(*buf, size);
+	if (!p)
+		return false;
+	*buf = p;
+	*cap = size;
+	return true;
+}
+
+static bool deque_pop(deque_t *D, u32 *job)
+{
+	pthread_mutex_lock(&D->lock);
+	bool ok = D->top < D->bottom;
+	if (ok)
+		*job = D->jobs[--D->bottom];
+	pthread_mutex_unlock(&D->lock);
+	return ok;
+}
+
+static bool deque_steal(deque_t *D, u32 *job)
+{
+	pthread_mutex_lock(&D->lock);
+	bool ok = D->top < D->bottom;
+	if (ok)
+		*job = D->jobs[D->top++];
+	pthread_mutex_unlock(&D->lock);
+	return ok;
+}
+
+/* uncompress the source into worker's scratch, return its size or -1 */
+static u32 load_source(worker_t *W, const batch_job_t *J, const u8 **data)
+{
+	if (J->source == BatchSourceRaw) {
+		*data = J->src;
+		return J->src_size;
+	}
+	uncomp_stream_t *S = malloc(sizeof(*S));
+	if (!S)
+		return -1;
+	if (J->source == BatchSourceKoei)
+		koei_lz77_stream_init(S, J->src, J->src_avail);
+	else
+		uncomp_stream_init(S, J->src, J->src_avail);
+	const u32 max = 0x1000000; // one more than a stream can hold, a Koei stream without end stops here
+	u32 size = 0;
+	while (!S->end && size < max) {
+		if (!reserve(&W->raw, &W->raw_cap, size + 0x10000 < max ? size + 0x10000 : max))
+			break;
+		u32 cap = W->raw_cap < max ? W->raw_cap : max;
+		size += uncomp_stream_read(S, W->raw + size, cap - size);
+	}
+	if (!S->end || S->error)
+		size = -1;
+	free(S);
+	*data = W->raw;
+	return size;
+}
+
+static u32 compress(worker_t *W, const batch_job_t *J, const void *src, u32 size)
+{
+	void *dest = W->packed;
+	u32 effort = J->effort;
+	switch (J->codec) {
+		case BatchCodecBare:     return BareComp(dest, src, size);
+		case BatchCodecRL:       return RLComp(dest, src, size);
+		case BatchCodecLZ77:     return LZ77CompEx(dest, src, size, false, effort);
+		case BatchCodecLZ77Lazy: return LZ77CompEx(dest, src, size, true, effort);
+		case BatchCodecLZ77Opt:  return LZ77CompOpt(dest, src, size, effort);
+		case BatchCodecHuff4:    return HuffCompEx(dest, src, size, false, &W->huff);
+		case BatchCodecHuff8:    return HuffCompEx(dest, src, size, true, &W->huff);
+		case BatchCodecKoeiLZ77: return koei_lz77_compress_ex(dest, src, size, effort);
+		case BatchCodecAuto:     return koei_compress(dest, src, size, effort | KOEI_COMP_AUTO | KOEI_COMP_INLINE);
+		default: return -1;
+	}
+}
+
+static void run_job(worker_t *W, batch_job_t *J)
+{
+	double t = now();
+	J->thread = W->id;
+	J->dest = NULL;
+	J->dest_size = -1;
+	const u8 *data;
+	u32 size = load_source(W, J, &data);
+	J->raw_size = size;
+	// large enough for every codec (Huffman codes are 20 bits at most)
+	if (size != (u32)-1 && size <= 0xFFFFFF && reserve(&W->packed, &W->packed_cap, size * 4 + 0x400)) {
+		u32 packed_size = compress(W, J, data, size);
+		if (packed_size != (u32)-1 && (J->dest = malloc(packed_size))) {
+			memcpy(J->dest, W->packed, packed_size);
+			J->dest_size = packed_size;
+		}
+	}
+	J->time = now() - t;
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *W = arg;
+	pool_t *P = W->pool;
+	u32 job;
+	while (1) {
+		if (deque_pop(&W->deque, &job)) {
+			run_job(W, &P->jobs[job]);
+			continue;
+		}
+		bool stolen = false;
+		for (u32 i = 1; i < P->num_workers && !stolen; ++i)
+			stolen = deque_steal(&P->workers[(W->id + i) % P->num_workers].deque, &job);
+		if (!stolen) // no job would be added, so all are taken
+			break;
+		++W->steals;
+		run_job(W, &P->jobs[job]);
+	}
+	return NULL;
+}
+
+/* larger first */
+static int cmp_key(const void *a, const void *b)
+{
+	u64 x = *(u64*)a, y = *(u64*)b;
+	return (x > y) - (x < y);
+}
+
+err_t batch_run(batch_job_t *jobs, u32 num_jobs, u32 num_threads, batch_stats_t *stats)
+{
+	if (!num_threads)
+		num_threads = batch_num_cpus();
+	if (num_threads > num_jobs)
+		num_threads = num_jobs ? num_jobs : 1;
+	double t = now();
+	err_t err = ERR_OK;
+	pool_t P = {.jobs = jobs, .num_workers = num_threads};
+	u64 *order = alloc(num_jobs + 1, order); // ~size << 32 | index
+	P.workers = allocz(num_threads, P.workers);
+	pthread_t *threads = alloc(num_threads, threads);
+	if (!order || !P.workers || !threads) {
+		err = ERR_MEMORYOUT;
+		goto clean;
+	}
+	// deal jobs largest first, round robin
+	for (u32 i = 0; i < num_jobs; ++i)
+		order[i] = (u64)~jobs[i].src_size << 32 | i;
+	qsort(order, num_jobs, sizeof(*order), cmp_key);
+	for (u32 i = 0; i < num_threads; ++i) {
+		worker_t *W = &P.workers[i];
+		W->pool = &P;
+		W->id = i;
+		pthread_mutex_init(&W->deque.lock, NULL);
+		W->deque.jobs = alloc(num_jobs / num_threads + 1, W->deque.jobs);
+		if (!W->deque.jobs)
+			err = ERR_MEMORYOUT;
+	}
+	if (err)
+		goto clean;
+	// the largest are popped first, so they are at the bottom
+	for (u32 i = num_jobs; i--; ) {
+		deque_t *D = &P.workers[i % num_threads].deque;
+		D->jobs[D->bottom++] = (u32)order[i];
+	}
+	// the calling thread is worker 0
+	u32 started = 1;
+	for (; started < num_threads; ++started)
+		if (pthread_create(&threads[started], NULL, worker_main, &P.workers[started]))
+			break;
+	worker_main(&P.workers[0]);
+	for (u32 i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	// workers failed to start left their jobs, which are stolen by the others
+
+	if (stats) {
+		*stats = (batch_stats_t){.threads = started};
+		for (u32 i = 0; i < num_jobs; ++i) {
+			batch_job_t *J = &jobs[i];
+			++stats->done;
+			if (!J->dest) {
+				++stats->failed;
+				continue;
+			}
+			stats->raw_size += J->raw_size;
+			stats->dest_size += J->dest_size;
+			stats->job_time += J->time;
+		}
+		for (u32 i = 0; i < num_threads; ++i)
+			stats->steals += P.workers[i].steals;
+		stats->time = now() - t;
+	}
+clean:
+	if (P.workers) {
+		for (u32 i = 0; i < num_threads; ++i) {
+			worker_t *W = &P.workers[i];
+			if (W->pool)
+				pthread_mutex_destroy(&W->deque.lock);
+			free(W->deque.jobs);
+			free(W->raw);
+			free(W->packed);
+		}
+	}
+	free(P.workers);
+	free(threads);
+	free(order);
+	return err;
+}
@@ -0,0 +1,57 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "core.h"
+#include "gba.h"
+
+/* batch recompression */
+
+typedef enum BatchSource {
+	BatchSourceRaw, // uncompressed data
+	BatchSourceBIOS, // BIOS compressed stream (Bare, RL, LZ77, Huffman)
+	BatchSourceKoei // Koei LZ77 stream
+} BatchSource;
+
+typedef enum BatchCodec {
+	BatchCodecBare,
+	BatchCodecRL,
+	BatchCodecLZ77, // effort: LZ77CompEx effort
+	BatchCodecLZ77Lazy, // effort: LZ77CompEx effort
+	BatchCodecLZ77Opt, // effort: LZ77CompOpt effort
+	BatchCodecHuff4,
+	BatchCodecHuff8,
+	BatchCodecKoeiLZ77, // effort: KOEI_LZ77_*
+	BatchCodecAuto // effort: KOEI_COMP_* flags
+} BatchCodec;
+
+typedef struct batch_job_t {
+	// input
+	const u8 *src;
+	u32 src_size; // of uncompressed data, or an estimate for compressed stream (to order jobs)
+	u32 src_avail; // bytes readable at src, a compressed stream fails if it runs past
+	BatchSource source;
+	BatchCodec codec;
+	u32 effort;
+	// output
+	u8 *dest; // malloc'd, NULL if failed
+	u32 raw_size; // uncompressed size
+	u32 dest_size;
+	double time; // seconds
+	u32 thread; // worker which ran the job
+} batch_job_t;
+
+typedef struct batch_stats_t {
+	u32 threads;
+	u32 done;
+	u32 failed;
+	u64 raw_size; // sum of uncompressed size
+	u64 dest_size; // sum of compressed size
+	double time; // wall time
+	double job_time; // sum of job time
+	u32 steals; // jobs run by other workers than the owner
+} batch_stats_t;
+
+u32 batch_num_cpus(void);
+err_t batch_run(batch_job_t *jobs, u32 num_jobs, u32 num_threads, batch_stats_t *stats);
+
+#endif // _BATCH_H
@@ -0,0 +1,359 @@
+/**
+ * codec benchmark
+ * usage: bench [-o <json>] [-s <size>] [-t <seconds>] [<file>[@<offset>[+<size>]] ...]
+ *
+ * every input of the corpus (synthetic inputs and user-supplied ROM slices) is compressed and
+ * uncompressed by each codec, reported as JSON:
+ * compress/uncompress speed (MB/s), ratio (packed / unpacked), peak heap of compressor/uncompressor,
+ * and whether the round trip (and the reference decoder, if any) gives the same bytes.
+ *
+ * heap is counted by wrapping malloc family at link time (see Makefile), stack is not counted.
+ * blocks of all threads are counted (auto runs its trials on helper threads), time is wall time.
+ */
+
+#include "core/gba.h"
+#include "core/koei.h"
+#include "corpus.h"
+#include "utils/io.h"
+#include "utils/json.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+//////////
+// heap //
+//////////
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+#define HEAP_SLOTS 1024
+
+static struct {void *p; size_t size;} Heap_Live[HEAP_SLOTS]; // tracked blocks
+static bool Heap_Track;
+static size_t Heap_Curr, Heap_Peak;
+static atomic_flag Heap_Lock = ATOMIC_FLAG_INIT; // guards the above, a spin lock never allocates
+
+static void heap_lock(void)
+{
+	while (atomic_flag_test_and_set_explicit(&Heap_Lock, memory_order_acquire));
+}
+
+static void heap_unlock(void)
+{
+	atomic_flag_clear_explicit(&Heap_Lock, memory_order_release);
+}
+
+static size_t *heap_find(void *p, bool empty)
+{
+	size_t i = ((uintptr_t)p >> 4) % HEAP_SLOTS;
+	for (size_t n = 0; n < HEAP_SLOTS; ++n, i = (i + 1) % HEAP_SLOTS)
+		if (Heap_Live[i].p == (empty ? NULL : p))
+			return &Heap_Live[i].size;
+	return NULL;
+}
+
+static void heap_add(void *p, size_t size)
+{
+	if (!p)
+		return;
+	heap_lock();
+	size_t *s = Heap_Track ? heap_find(NULL, true) : NULL;
+	if (s) {
+		Heap_Live[s - &Heap_Live[0].size].p = p;
+		*s = size;
+		if ((Heap_Curr += size) > Heap_Peak)
+			Heap_Peak = Heap_Curr;
+	}
+	heap_unlock();
+}
+
+static void heap_del(void *p)
+{
+	if (!p)
+		return;
+	heap_lock();
+	size_t *s = heap_find(p, false);
+	if (s) {
+		Heap_Curr -= *s;
+		Heap_Live[s - &Heap_Live[0].size].p = NULL;
+	}
+	heap_unlock();
+}
+
+void *__wrap_malloc(size_t size)
+{
+	void *p = __real_malloc(size);
+	heap_add(p, size);
+	return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	void *p = __real_calloc(n, size);
+	heap_add(p, n * size);
+	return p;
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	heap_del(p);
+	p = __real_realloc(p, size);
+	heap_add(p, size);
+	return p;
+}
+
+void __wrap_free(void *p)
+{
+	heap_del(p);
+	__real_free(p);
+}
+
+static void heap_begin(void)
+{
+	heap_lock();
+	Heap_Curr = Heap_Peak = 0;
+	Heap_Track = true;
+	heap_unlock();
+}
+
+static size_t heap_end(void)
+{
+	heap_lock();
+	Heap_Track = false;
+	size_t peak = Heap_Peak;
+	heap_unlock();
+	return peak;
+}
+
+////////////
+// codecs //
+////////////
+
+typedef u32 (*comp_t)(void *dest, const void *src, u32 src_size);
+typedef void (*uncomp_t)(void *dest, const void *src, u32 *psize);
+
+static u32 lz77_greedy(void *dest, const void *src, u32 src_size) { return LZ77Comp(dest, src, src_size, false); }
+static u32 lz77_lazy(void *dest, const void *src, u32 src_size) { return LZ77Comp(dest, src, src_size, true); }
+static u32 lz77_optimal(void *dest, const void *src, u32 src_size) { return LZ77CompOpt(dest, src, src_size, LZ77_EFFORT_DEFAULT); }
+static u32 huff4(void *dest, const void *src, u32 src_size) { return HuffComp4(dest, src, src_size); }
+static u32 huff8(void *dest, const void *src, u32 src_size) { return HuffComp8(dest, src, src_size); }
+static u32 koei_greedy(void *dest, const void *src, u32 src_size) { return koei_lz77_compress_ex(dest, src, src_size, KOEI_LZ77_GREEDY); }
+static u32 koei_optimal(void *dest, const void *src, u32 src_size) { return koei_lz77_compress_ex(dest, src, src_size, KOEI_LZ77_OPTIMAL); }
+static u32 koei_auto(void *dest, const void *src, u32 src_size) { return koei_compress(dest, src, src_size, KOEI_COMP_AUTO | KOEI_COMP_FILTER); }
+
+static const struct codec_t {
+	const char *name;
+	comp_t comp;
+	uncomp_t uncomp;
+	uncomp_t uncomp_ref; // reference decoder to cross-check, or NULL
+} Codecs[] = {
+	{"Bare", BareComp, BareUnComp, NULL},
+	{"RL", RLComp, RLUnCompFast, RLUnComp},
+	{"LZ77", lz77_greedy, LZ77UnCompFast, LZ77UnComp},
+	{"LZ77Lazy", lz77_lazy, LZ77UnCompFast, LZ77UnComp},
+	{"LZ77Opt", lz77_optimal, LZ77UnCompFast, LZ77UnComp},
+	{"Huff4", huff4, HuffUnComp, NULL},
+	{"Huff8", huff8, HuffUnComp, NULL},
+	{"KoeiLZ77", koei_greedy, koei_lz77_uncompress, NULL},
+	{"KoeiLZ77Opt", koei_optimal, koei_lz77_uncompress, NULL},
+	{"Auto", koei_auto, koei_uncompress, NULL},
+};
+
+////////////
+// corpus //
+////////////
+
+typedef struct input_t {
+	char name[64];
+	u8 *data;
+	u32 size;
+} input_t;
+
+/**
+ * load `<file>[@<offset>[+<size>]]`, a ROM address (0x8000000+) is accepted as offset
+ */
+static bool load_slice(input_t *in, const char *arg)
+{
+	char name[FILENAME_MAX];
+	snprintf(name, sizeof(name), "%s", arg);
+	char *at = strrchr(name, '@');
+	u32 of = 0, size = -1;
+	if (at) {
+		*at++ = '\0';
+		char *plus = strchr(at, '+');
+		of = strtoul(at, NULL, 0);
+		if (plus)
+			size = strtoul(plus + 1, NULL, 0);
+		if (of >= ROM_BASE)
+			of -= ROM_BASE;
+	}
+	u8 *buf;
+	u32 buf_size;
+	if (!readfile(name, &buf, &buf_size))
+		return false;
+	if (of >= buf_size) {
+		free(buf);
+		return false;
+	}
+	if (size > buf_size - of)
+		size = buf_size - of;
+	if (size > 0xFFFFFF) // size in header is 24-bit
+		size = 0xFFFFFF;
+	in->data = malloc(size);
+	memcpy(in->data, buf + of, size);
+	in->size = size;
+	free(buf);
+	snprintf(in->name, sizeof(in->name), "%s", arg);
+	return true;
+}
+
+///////////
+// bench //
+///////////
+
+/* monotonic wall time, CPU time would add up the helper threads of auto */
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_val(jobj_t obj, const char *key, struct _jsonval val)
+{
+	json_add(obj, key, &val);
+}
+
+static void add_obj(jobj_t obj, const char *key, jobj_t child)
+{
+	add_val(obj, key, (struct _jsonval){.t = JT_OBJECT, .o = child});
+	json_free(child);
+}
+
+static jobj_t bench_codec(const struct codec_t *c, const input_t *in, double min_time)
+{
+	u32 n = in->size;
+	u8 *packed = malloc(n * 2 + 0x1000);
+	u8 *out = malloc(n + 0x100), *ref = malloc(n + 0x100);
+	jobj_t obj = json_load("{}");
+
+	// compress
+	u32 packed_size = 0, rounds = 0;
+	size_t comp_heap = 0;
+	double t0 = now(), t;
+	do {
+		heap_begin();
+		packed_size = c->comp(packed, in->data, n);
+		size_t peak = heap_end();
+		if (peak > comp_heap)
+			comp_heap = peak;
+		++rounds;
+	} while ((t = now() - t0) < min_time);
+	double comp_speed = t > 0 ? (double)n * rounds / t / 1e6 : 0;
+	bool ok = packed_size != (u32)-1;
+
+	// uncompress
+	double uncomp_speed = 0;
+	size_t uncomp_heap = 0;
+	if (ok) {
+		u32 size;
+		rounds = 0;
+		t0 = now();
+		do {
+			size = n + 0x100;
+			heap_begin();
+			c->uncomp(out, packed, &size);
+			size_t peak = heap_end();
+			if (peak > uncomp_heap)
+				uncomp_heap = peak;
+			++rounds;
+		} while ((t = now() - t0) < min_time);
+		uncomp_speed = t > 0 ? (double)n * rounds / t / 1e6 : 0;
+		ok = size == n && !memcmp(out, in->data, n);
+		if (ok && c->uncomp_ref) {
+			size = n + 0x100;
+			c->uncomp_ref(ref, packed, &size);
+			ok = size == n && !memcmp(ref, out, n);
+		}
+	}
+
+	add_val(obj, "comp_mbps", (struct _jsonval){.t = JT_REAL, .r = comp_speed});
+	add_val(obj, "uncomp_mbps", (struct _jsonval){.t = JT_REAL, .r = uncomp_speed});
+	add_val(obj, "packed_size", (struct _jsonval){.t = JT_LONG, .l = ok ? (jlong_t)packed_size : -1});
+	add_val(obj, "ratio", (struct _jsonval){.t = JT_REAL, .r = ok && n ? (double)packed_size / n : 0});
+	add_val(obj, "comp_peak_heap", (struct _jsonval){.t = JT_LONG, .l = comp_heap});
+	add_val(obj, "uncomp_peak_heap", (struct _jsonval){.t = JT_LONG, .l = uncomp_heap});
+	add_val(obj, "ok", (struct _jsonval){.t = JT_BOOL, .b = ok});
+	free(packed);
+	free(out);
+	free(ref);
+	return obj;
+}
+
+int main(int argc, const char *argv[])
+{
+	const char *out_name = NULL;
+	u32 gen_size = 0x10000;
+	double min_time = 0.2;
+	input_t *inputs = malloc((lenof(Generators) + argc) * sizeof(*inputs));
+	u32 n = 0;
+
+	for (u32 i = 0; i < lenof(Generators); ++i, ++n) {
+		snprintf(inputs[n].name, sizeof(inputs[n].name), "%s", Generators[i].name);
+		inputs[n].size = gen_size;
+	}
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			out_name = argv[++i];
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			gen_size = strtoul(argv[++i], NULL, 0);
+			for (u32 j = 0; j < lenof(Generators); ++j)
+				inputs[j].size = gen_size;
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			min_time = strtod(argv[++i], NULL);
+		} else if (load_slice(&inputs[n], argv[i])) {
+			++n;
+		} else {
+			fprintf(stderr, "cannot load %s\n", argv[i]);
+		}
+	}
+	for (u32 i = 0; i < lenof(Generators); ++i) {
+		inputs[i].data = malloc(inputs[i].size);
+		Generators[i].gen(inputs[i].data, inputs[i].size);
+	}
+
+	jobj_t root = json_load("{}");
+	jobj_t corpus = json_load("{}");
+	for (u32 i = 0; i < n; ++i) {
+		jobj_t item = json_load("{}");
+		jobj_t codecs = json_load("{}");
+		add_val(item, "size", (struct _jsonval){.t = JT_LONG, .l = inputs[i].size});
+		for (u32 j = 0; j < lenof(Codecs); ++j) {
+			fprintf(stderr, "%s: %s\n", inputs[i].name, Codecs[j].name);
+			add_obj(codecs, Codecs[j].name, bench_codec(&Codecs[j], &inputs[i], min_time));
+		}
+		add_obj(item, "codecs", codecs);
+		add_obj(corpus, inputs[i].name, item);
+		free(inputs[i].data);
+	}
+	add_obj(root, "corpus", corpus);
+
+	char *s = json_save(root, true);
+	FILE *fp = out_name ? fopen(out_name, "w") : stdout;
+	if (fp) {
+		fputs(s, fp);
+		fputc('\n', fp);
+		if (fp != stdout)
+			fclose(fp);
+	}
+	free(s);
+	json_free(root);
+	free(inputs);
+	return 0;
+}
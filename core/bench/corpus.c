@@ -0,0 +1,68 @@
+#include "corpus.h"
+
+static u32 Rand_State = 1;
+
+void corpus_seed(u32 seed)
+{
+	Rand_State = seed ? seed : 1;
+}
+
+u32 rand32(void)
+{
+	Rand_State ^= Rand_State << 13;
+	Rand_State ^= Rand_State >> 17;
+	Rand_State ^= Rand_State << 5;
+	return Rand_State;
+}
+
+static void gen_random(u8 *p, u32 n)
+{
+	for (u32 i = 0; i < n; ++i)
+		p[i] = rand32();
+}
+
+static void gen_text(u8 *p, u32 n) // script-like, Shift_JIS words and control codes
+{
+	static const char *words[] = {
+		"\x97\xAA\x94\xF5", "\x91\x80\x91\x80", "\x8A\xD6\x89\x48", "\x92\xA3\x94\xF2", "\x82\xCD", "\x82\xAA",
+		"\x82\xF0", "\x82\xC5\x82\xB7", "\x81\x42", "\x81\x41", "\x8F\xE9", "\x95\xBA", "\xFF\x01", "\xFF\x00\x0A"
+	};
+	for (u32 i = 0; i < n; ) {
+		const char *w = words[rand32() % lenof(words)];
+		while (*w && i < n)
+			p[i++] = *w++;
+	}
+}
+
+static void gen_runs(u8 *p, u32 n) // map-like, long runs of a few values
+{
+	for (u32 i = 0; i < n; ) {
+		u32 len = rand32() % 48 + 1;
+		u8 b = rand32() % 6;
+		while (len-- && i < n)
+			p[i++] = b;
+	}
+}
+
+static void gen_tiles(u8 *p, u32 n) // 4bpp tiles with a few colors per tile
+{
+	for (u32 i = 0; i < n; i += 32) {
+		u8 c[4] = {0, rand32() & 0xF, rand32() & 0xF, rand32() & 0xF};
+		for (u32 j = 0; j < 32 && i + j < n; ++j)
+			p[i + j] = c[rand32() & 3] | c[rand32() & 3] << 4;
+	}
+}
+
+static void gen_sparse(u8 *p, u32 n) // mostly zero
+{
+	for (u32 i = 0; i < n; ++i)
+		p[i] = rand32() % 16 ? 0 : rand32();
+}
+
+const corpus_gen_t Generators[NUM_GENERATORS] = {
+	{"random", gen_random},
+	{"text", gen_text},
+	{"runs", gen_runs},
+	{"tiles", gen_tiles},
+	{"sparse", gen_sparse},
+};
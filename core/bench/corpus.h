@@ -0,0 +1,21 @@
+#ifndef _CORPUS_H
+#define _CORPUS_H
+
+#include "core/core.h"
+#include "core/gba.h"
+
+/* synthetic inputs of bench and test, the same sequence for the same seed */
+
+#define NUM_GENERATORS 5
+
+typedef struct corpus_gen_t {
+	const char *name;
+	void (*gen)(u8 *p, u32 n);
+} corpus_gen_t;
+
+extern const corpus_gen_t Generators[NUM_GENERATORS];
+
+void corpus_seed(u32 seed);
+u32 rand32(void);
+
+#endif // _CORPUS_H
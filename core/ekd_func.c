@@ -2,34 +2,371 @@
 #include "koei.h"
 #include "ekd.h"
 #include "ekd_func.h"
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-u32 ekd_uncompress(void *dest, const void *src)
+////////////
+// decode //
+////////////
+
+/**
+ * compared to KMD, the compress header is encoded into the raw data:
+ * LZ77 output starts with it, and Huffman output is compressed by LZ77 again unless it starts with 0.
+ * the outer stream is piped into the inner LZ77 decoder, which writes the final data with the header dropped.
+ */
+
+/* input of LZ77, in memory or pulled from the outer stream */
+typedef struct pipe_t {
+	const u8 *p, *end; // buffered input
+	uncomp_stream_t *S; // NULL if all input is in memory
+	u8 buf[0x200];
+} pipe_t;
+
+static inline int pipe_getc(pipe_t *P)
+{
+	if (P->p == P->end) {
+		u32 n = P->S ? uncomp_stream_read(P->S, P->buf, sizeof(P->buf)) : 0;
+		if (!n)
+			return -1;
+		P->p = P->buf;
+		P->end = P->buf + n;
+	}
+	return *P->p++;
+}
+
+/* LZ77 data of `size` bytes, the first 4 are the header and not written to `dest` */
+static u32 pipe_lz77(pipe_t *P, u8 *dest, u32 size)
+{
+	u8 head[4];
+	u32 pos = 0;
+	while (pos < size) {
+		// a flag of 8 matches is at most 17 bytes in and 144 bytes out, plus 7 bytes of wide copy
+		if (pos >= 4 && size - pos >= 8 * 18 + 8 && P->end - P->p >= 17) {
+			const u8 *in = P->p;
+			u8 f = *in++, *d = dest + pos - 4;
+			for (u32 i = 0; i < 8; ++i, f <<= 1) {
+				if (!(f & 0x80)) { // raw
+					*d++ = *in++;
+					continue;
+				}
+				u32 len = (in[0] >> 4) + 3, of = ((in[0] & 0xF) << 8 | in[1]) + 1;
+				in += 2;
+				u32 at = d - dest + 4;
+				if (of + 4 > at) { // from the header
+					if (of > at) // before the beginning
+						return 0;
+					for (u32 k = 0; k < len; ++k) {
+						u32 from = at + k - of;
+						*d++ = from < 4 ? head[from] : dest[from - 4];
+					}
+					continue;
+				}
+				const u8 *s = d - of;
+				if (of >= 8) {
+					for (u32 k = 0; k < len; k += 8)
+						memcpy(d + k, s + k, 8);
+				} else {
+					for (u32 k = 0; k < len; ++k)
+						d[k] = s[k];
+				}
+				d += len;
+			}
+			P->p = in;
+			pos = d - dest + 4;
+			continue;
+		}
+		int f = pipe_getc(P);
+		if (f < 0)
+			return 0;
+		for (u32 i = 0; i < 8 && pos < size; ++i, f <<= 1) {
+			if (f & 0x80) { // offset + length
+				int b0 = pipe_getc(P), b1 = pipe_getc(P);
+				if (b1 < 0)
+					return 0;
+				u32 len = (b0 >> 4) + 3, of = (b1 | (b0 & 0xF) << 8) + 1;
+				if (of > pos) // before the beginning
+					return 0;
+				if (len > size - pos)
+					len = size - pos;
+				if (pos - of >= 4) { // all in `dest`
+					u8 *d = dest + pos - 4;
+					const u8 *s = d - of;
+					for (u32 k = 0; k < len; ++k)
+						d[k] = s[k];
+					pos += len;
+					continue;
+				}
+				for (u32 k = 0; k < len; ++k, ++pos) {
+					u32 from = pos - of;
+					u8 c = from < 4 ? head[from] : dest[from - 4];
+					if (pos < 4)
+						head[pos] = c;
+					else
+						dest[pos - 4] = c;
+				}
+			} else { // raw
+				int c = pipe_getc(P);
+				if (c < 0)
+					return 0;
+				if (pos < 4)
+					head[pos] = c;
+				else
+					dest[pos - 4] = c;
+				++pos;
+			}
+		}
+	}
+	return size - 4;
+}
+
+/* decoder of src */
+typedef struct ekd_dec_t {
+	const u8 *src;
+	u8 head[4]; // output of the outer stream
+	bool nested; // LZ77 again
+	u32 size; // final size
+	uncomp_stream_t S; // outer stream, not used by LZ77
+} ekd_dec_t;
+
+/* return the final size, 0 if not supported */
+static u32 ekd_open(ekd_dec_t *D, const void *src)
 {
 	u8 type = *(u8*)src;
+	u32 size = *(u32*)src >> 8;
+	D->src = src;
+	D->nested = false;
+	D->size = 0;
 	if (type && type != 0x10 && type != 0x24 && type != 0x28) // only bare, LZ77 and Huff supported
 		return 0;
-	u32 size = *(u16*)(src + 1);
-	u8 *dst = malloc(size);
-	koei_uncompress(dst, src, &size);
-	// compared to KMD, the compress header is encoded into the raw data
-	if ((type & 0x20) && *(u8*)dst) { // has been compressed by LZ77 again
-		u32 size = *(u16*)(dst + 1);
-		*(void**)dest = malloc(size);
-		if (*(void**)dest) {
-			LZ77UnComp(*(void**)dest, dst, &size);
-			memmove(*(void**)dest, *(void**)dest + 4, size - 4);
-		} else {
-			size = 0;
+	if (size < 4)
+		return 0;
+	if (type == 0x10) // LZ77 is read from memory
+		return D->size = size - 4;
+	const u8 *p = src;
+	u32 avail = p >= ROM && p < ROM + ROM_size ? ROM + ROM_size - p : -1; // bounded within ROM
+	uncomp_stream_init(&D->S, src, avail);
+	if (uncomp_stream_read(&D->S, D->head, 4) != 4)
+		return 0;
+	if ((type & 0x20) && D->head[0]) {
+		D->nested = true;
+		size = D->head[1] | D->head[2] << 8;
+		return D->size = size < 4 ? 0 : size - 4;
+	}
+	return D->size = size;
+}
+
+/* decode into `dest` of D->size bytes, return the size, 0 if failed */
+static u32 ekd_decode(ekd_dec_t *D, u8 *dest)
+{
+	u32 size = D->size;
+	if (*D->src == 0x10) {
+		// input is at most a flag byte and 8 bytes per 8 bytes of output (header included), and within ROM
+		u32 n = size + 4, max = n + (n + 7) / 8;
+		const u8 *p = D->src + 4;
+		if (p >= ROM && p <= ROM + ROM_size && max > ROM + ROM_size - p)
+			max = ROM + ROM_size - p;
+		pipe_t P = {.p = p, .end = p + max};
+		return pipe_lz77(&P, dest, n);
+	}
+	if (D->nested) {
+		pipe_t P = {.S = &D->S};
+		return pipe_lz77(&P, dest, size + 4);
+	}
+	memcpy(dest, D->head, 4);
+	return uncomp_stream_read(&D->S, dest + 4, size - 4) == size - 4 ? size : 0;
+}
+
+/* size of the decompressed data, 0 if not supported */
+u32 ekd_uncompressed_size(const void *src)
+{
+	ekd_dec_t D;
+	return ekd_open(&D, src);
+}
+
+/* decompress into `dest` of `cap` bytes, return the size, 0 if failed */
+u32 ekd_uncompress_into(void *dest, u32 cap, const void *src)
+{
+	ekd_dec_t D;
+	u32 size = ekd_open(&D, src);
+	if (!size || size > cap)
+		return 0;
+	return ekd_decode(&D, dest);
+}
+
+/* decompress into the arena, return the data (8-byte aligned), NULL if failed or out of space */
+void *ekd_uncompress_arena(ekd_arena_t *A, const void *src, u32 *psize)
+{
+	u32 used = (A->used + 7) & ~7;
+	if (used > A->size)
+		return NULL;
+	u32 size = ekd_uncompress_into(A->base + used, A->size - used, src);
+	if (!size)
+		return NULL;
+	A->used = used + size;
+	if (psize)
+		*psize = size;
+	return A->base + used;
+}
+
+///////////
+// cache //
+///////////
+
+/**
+ * decompressed blobs are kept in an LRU list, keyed by source pointer and its header word.
+ * the header only tells type and size, so the cache is emptied once ROM_version changes
+ * (ROM is loaded, resized or modified), otherwise a patched or reloaded ROM would hit a stale blob.
+ * blobs handed out hold a reference, and are freed on the last ekd_release once evicted.
+ * not thread safe, like the ROM itself.
+ */
+
+typedef struct blob_t {
+	struct blob_t *prev, *next; // LRU list, most recent first
+	struct blob_t *chain; // hash chain
+	const void *src;
+	u32 key; // header word of src
+	u32 size; // returned by ekd_uncompress
+	u32 cap; // allocated data size
+	u32 refs;
+	bool cached;
+	_Alignas(8) u8 data[];
+} blob_t;
+
+#define CACHE_HASH_SIZE 256
+
+static struct {
+	blob_t *head, *tail;
+	blob_t *hash[CACHE_HASH_SIZE];
+	u32 size; // sum of cap of cached blobs
+	u32 limit;
+	u32 version; // ROM_version of cached blobs
+} Cache = {.limit = EKD_CACHE_LIMIT};
+
+#define blob_of(p) ((blob_t*)((u8*)(p) - offsetof(blob_t, data)))
+
+static inline u32 cache_hash(const void *src)
+{
+	return (u32)((uintptr_t)src >> 2) * 0x9E3779B1u >> 24;
+}
+
+static blob_t *blob_new(u32 cap)
+{
+	blob_t *b = malloc(sizeof(blob_t) + cap);
+	if (b)
+		*b = (blob_t){.cap = cap};
+	return b;
+}
+
+static void cache_unlink(blob_t *b)
+{
+	*(b->prev ? &b->prev->next : &Cache.head) = b->next;
+	*(b->next ? &b->next->prev : &Cache.tail) = b->prev;
+	blob_t **pp = &Cache.hash[cache_hash(b->src)];
+	while (*pp != b)
+		pp = &(*pp)->chain;
+	*pp = b->chain;
+	Cache.size -= b->cap;
+	b->cached = false;
+	if (!b->refs)
+		free(b);
+}
+
+static void cache_push(blob_t *b)
+{
+	b->prev = NULL;
+	b->next = Cache.head;
+	*(Cache.head ? &Cache.head->prev : &Cache.tail) = b;
+	Cache.head = b;
+}
+
+static void cache_trim(u32 limit)
+{
+	while (Cache.tail && Cache.size > limit)
+		cache_unlink(Cache.tail);
+}
+
+static void cache_insert(blob_t *b)
+{
+	if (b->cap > Cache.limit)
+		return;
+	cache_trim(Cache.limit - b->cap);
+	u32 h = cache_hash(b->src);
+	b->chain = Cache.hash[h];
+	Cache.hash[h] = b;
+	cache_push(b);
+	Cache.size += b->cap;
+	b->cached = true;
+}
+
+static blob_t *cache_find(const void *src, u32 key)
+{
+	for (blob_t *b = Cache.hash[cache_hash(src)]; b; b = b->chain) {
+		if (b->src == src && b->key == key) {
+			if (b != Cache.head) { // move to front
+				*(b->prev ? &b->prev->next : &Cache.head) = b->next;
+				*(b->next ? &b->next->prev : &Cache.tail) = b->prev;
+				cache_push(b);
+			}
+			return b;
 		}
-		free(dst);
-	} else {
-		if (type & 0x10)
-			memmove(dst, dst + 4, size - 4);
-		*(void**)dest = dst;
 	}
-	return size;
+	return NULL;
+}
+
+/* bytes of decompressed data kept, 0 to disable */
+void ekd_cache_limit(u32 limit)
+{
+	Cache.limit = limit;
+	cache_trim(limit);
+}
+
+/* evict everything, blobs still referenced stay valid until released */
+void ekd_cache_clear(void)
+{
+	cache_trim(0);
+}
+
+/* release a blob returned by ekd_uncompress */
+void ekd_release(const void *data)
+{
+	if (!data)
+		return;
+	blob_t *b = blob_of(data);
+	if (!--b->refs && !b->cached)
+		free(b);
+}
+
+/**
+ * *dest is the decompressed data, shared with the cache: call ekd_release, not free.
+ * return the size, 0 if failed
+ */
+u32 ekd_uncompress(void *dest, const void *src)
+{
+	*(void**)dest = NULL;
+	if (Cache.version != ROM_version) {
+		cache_trim(0);
+		Cache.version = ROM_version;
+	}
+	u32 key = *(u32*)src;
+	blob_t *b = cache_find(src, key);
+	if (!b) {
+		ekd_dec_t D;
+		u32 size = ekd_open(&D, src);
+		if (!size || !(b = blob_new(size)))
+			return 0;
+		b->size = ekd_decode(&D, b->data);
+		if (!b->size) {
+			free(b);
+			return 0;
+		}
+		b->src = src;
+		b->key = key;
+		cache_insert(b);
+	}
+	++b->refs;
+	*(void**)dest = b->data;
+	return b->size;
 }
 
 
@@ -50,9 +387,9 @@ void ekd_draw_HEXmap(drawparam_t *dp, u32 id)
 	dp->w = HEXmapSizeTable[id][0];
 	dp->h = HEXmapSizeTable[id][1];
 	draw_image(dp);
-	free(dp->tile_bank);
-	free(dp->pal_bank);
-	free(dp->map_data);
+	ekd_release(dp->tile_bank);
+	ekd_release(dp->pal_bank);
+	ekd_release(dp->map_data);
 }
 
 void ekd_draw_avatar(drawparam_t *dp, u32 id)
@@ -67,6 +404,6 @@ void ekd_draw_avatar(drawparam_t *dp, u32 id)
 		map_data[i] = i;
 	dp->map_data = (scrdata_t*)map_data;
 	draw_image(dp);
-	free(dp->tile_bank);
-	free(dp->pal_bank);
+	ekd_release(dp->tile_bank);
+	ekd_release(dp->pal_bank);
 }
@@ -4,8 +4,22 @@
 #include "gba.h"
 #include "gba_video.h"
 
+#define EKD_CACHE_LIMIT 0x400000 /* default bytes of decompressed blobs cached */
 
+/* caller-provided memory, reset by setting `used` to 0 */
+typedef struct ekd_arena_t {
+	u8 *base;
+	u32 size;
+	u32 used;
+} ekd_arena_t;
+
+u32 ekd_uncompressed_size(const void *src);
+u32 ekd_uncompress_into(void *dest, u32 cap, const void *src);
+void *ekd_uncompress_arena(ekd_arena_t *A, const void *src, u32 *psize);
 u32 ekd_uncompress(void *dest, const void *src);
+void ekd_release(const void *data);
+void ekd_cache_limit(u32 limit);
+void ekd_cache_clear(void);
 void ekd_draw_HEXmap(drawparam_t *dp, u32 id);
 void ekd_draw_avatar(drawparam_t *dp, u32 id);
 
@@ -2,6 +2,7 @@
 #define _ENCODING_H
 
 #include "core/gba.h"
+#include <stddef.h>
 
 
 /* general */
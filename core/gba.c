@@ -2,6 +2,7 @@
 #include "utils/io.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 /////////
@@ -10,6 +11,19 @@
 
 u8 *PRAM, *VRAM, *OAM, *ROM; // Palette RAM, Video RAM, Object Attribute Memory, ROM
 u32 ROM_size;
+u32 ROM_version; // changed whenever ROM is loaded, freed, resized or modified
+
+/**
+ * ROM is either read into memory, or mapped copy-on-write from its file.
+ * modifications of mapped ROM are recorded by `mark_ROM` in pages,
+ * so that writing back to its file only writes the modified pages.
+ */
+static struct {
+	u8 *dirty; // bitmap of modified pages, NULL if ROM is not mapped
+	char *name; // mapped file
+	u64 id[2]; // identity of mapped file, see `fileid`
+	u32 size; // size of mapping
+} ROM_map;
 
 bool load_ROM(const char *name)
 {
@@ -17,15 +31,120 @@ bool load_ROM(const char *name)
 	return readfile(name, &ROM, &ROM_size);
 }
 
+bool map_ROM(const char *name)
+{
+	free_ROM();
+	if (!mapfile(name, &ROM, &ROM_size))
+		return false;
+	ROM_map.size = ROM_size;
+	ROM_map.dirty = calloc((ROM_size / ROM_PAGE_SIZE + 8) / 8, 1);
+	ROM_map.name = strdup(name);
+	if (!ROM_map.dirty || !ROM_map.name || !fileid(name, ROM_map.id)) {
+		free_ROM();
+		return false;
+	}
+	return true;
+}
+
 COREAPI void free_ROM(void)
 {
-	free(ROM);
+	if (ROM_map.dirty) {
+		unmapfile(ROM, ROM_map.size);
+		free(ROM_map.dirty);
+		free(ROM_map.name);
+		ROM_map.dirty = NULL;
+		ROM_map.name = NULL;
+	} else {
+		free(ROM);
+	}
 	ROM = NULL;
 	ROM_size = 0;
+	++ROM_version;
+}
+
+/**
+ * record modification of [offset, offset+size) of ROM,
+ * every modification should be recorded, so that data derived from ROM can be refreshed
+ */
+void mark_ROM(u32 offset, u32 size)
+{
+	++ROM_version;
+	if (!ROM_map.dirty || !size || offset >= ROM_size)
+		return;
+	u32 last = (size > ROM_size - offset ? ROM_size - 1 : offset + size - 1) / ROM_PAGE_SIZE;
+	for (u32 i = offset / ROM_PAGE_SIZE; i <= last; ++i)
+		ROM_map.dirty[i >> 3] |= 1 << (i & 7);
+}
+
+static inline bool is_dirty(u32 page)
+{
+	return ROM_map.dirty[page >> 3] >> (page & 7) & 1;
+}
+
+/* resize ROM, new bytes are 0xFF. mapped ROM is read into memory */
+bool resize_ROM(u32 size)
+{
+	u8 *rom = ROM_map.dirty ? malloc(size) : realloc(ROM, size);
+	if (!rom)
+		return false;
+	if (ROM_map.dirty) {
+		memcpy(rom, ROM, size < ROM_size ? size : ROM_size);
+		u32 n = ROM_size;
+		free_ROM();
+		ROM_size = n;
+	}
+	if (size > ROM_size)
+		memset(rom + ROM_size, 0xFF, size - ROM_size);
+	ROM = rom;
+	ROM_size = size;
+	++ROM_version;
+	return true;
+}
+
+/* write modified pages of mapped ROM back to its file */
+static bool write_dirty_pages(void)
+{
+	FILE *fp = fopen(ROM_map.name, "r+b");
+	if (!fp)
+		return false;
+	bool r = true;
+	u32 pages = (ROM_size + ROM_PAGE_SIZE - 1) / ROM_PAGE_SIZE;
+	for (u32 i = 0; i < pages && r; ) {
+		if (!is_dirty(i)) {
+			++i;
+			continue;
+		}
+		u32 j = i + 1;
+		while (j < pages && is_dirty(j))
+			++j;
+		u32 begin = i * ROM_PAGE_SIZE, end = j * ROM_PAGE_SIZE < ROM_size ? j * ROM_PAGE_SIZE : ROM_size;
+		r = !fseek(fp, begin, SEEK_SET) && fwrite(ROM + begin, 1, end - begin, fp) == end - begin;
+		i = j;
+	}
+	if (fclose(fp))
+		r = false;
+	if (r) // file is the same as the mapping now
+		memset(ROM_map.dirty, 0, (ROM_size / ROM_PAGE_SIZE + 8) / 8);
+	return r;
+}
+
+/* whether `name` is the mapped file, under any of its names */
+static bool is_mapped_file(const char *name)
+{
+	u64 id[2];
+	return ROM_map.dirty && fileid(name, id) && id[0] == ROM_map.id[0] && id[1] == ROM_map.id[1];
 }
 
 COREAPI void write_ROM(const char *name)
 {
+	if (is_mapped_file(name)) {
+		if (write_dirty_pages())
+			return;
+		// the file cannot be rewritten under its own mapping
+		if (!resize_ROM(ROM_size))
+			return;
+	}
+	// a new file, unmodified pages of mapped ROM come from the file cache
 	writefile(name, ROM, ROM_size);
 }
 
@@ -56,228 +175,434 @@ u32 RLComp(void *dest, const void *src, u32 src_size)
 	u8 *dest_org = dest;
 	*(u32*)dest = src_size << 8 | 0x30;
 	dest += 4;
-	while (p < (u8*)src + src_size) {
-		u8 b = *p++; // curr byte
-		u8 f = 1; // 1 if duplicate mode
-		int cnt = 1; // length
+	while (IS_IN_RANGE(p)) {
+		u8 b = *p; // curr byte
 		int dup = 1; // duplicate length
-		while (IS_IN_RANGE(p)) {
-			++cnt;
-			if (*p++ == b) { // duplicate
-				++dup;
-				if (!f && dup == 3) { // terminate non-dup mode, begin dup mode
-					p -= 3, cnt -= 3;
-					break;
-				}
-			} else { // neq
-				dup = 1;
-				if (f) {
-					if (dup >= 3) // dup len is enough, encode it
-						break;
-					f = 0; // dup len is too short, use non-dup mode
-				}
-			}
-			if (dup == 130) // cannot longer
-				break;
-			if (!f && cnt == 128) { // try twice at most (check dup len is enough)
-				CHECK_IN_RANGE(p);
-				if (*p == b) {
-					if (dup == 2) {
-						p -= 2; cnt -= 2;
-						break;
-					}
-					CHECK_IN_RANGE(p);
-					if (p[1] == b)
-						--p, --cnt;
-				}
-				break;
-			}
-		}
-		if (f) {
-			if (dup >= 3) { // dup mode
-				*(u8*)dest++ = 0x80 | (dup - 3);
-				*(u8*)dest++ = b;
-			} else { // only if reach the end
-				f = 0;
-			}
+		while (dup < 130 && IS_IN_RANGE(p + dup) && p[dup] == b)
+			++dup;
+		if (dup >= 3) { // dup mode
+			*(u8*)dest++ = 0x80 | (dup - 3);
+			*(u8*)dest++ = b;
+			p += dup;
+			continue;
 		}
-		if (!f) { // non-dup mode
-			*(u8*)dest++ = cnt - 1;
-			p -= cnt;
-			for (int i = 0; i < cnt; ++i)
-				*(u8*)dest++ = *p++;
+		// non-dup mode, stop before the next dup run of 3 bytes
+		int cnt = 0; // length
+		while (cnt < 128 && IS_IN_RANGE(p + cnt)) {
+			if (IS_IN_RANGE(p + cnt + 2) && p[cnt] == p[cnt + 1] && p[cnt] == p[cnt + 2])
+				break;
+			++cnt;
 		}
+		*(u8*)dest++ = cnt - 1;
+		memcpy(dest, p, cnt);
+		dest += cnt;
+		p += cnt;
 	}
 	return (u8*)dest - dest_org;
 }
 
+/**
+ * LZ77 match finder
+ * candidates are chained by the hash of their first 3 bytes (shorter matches are never encoded),
+ * `prev` is indexed by position in window, so a chain never leaves the window.
+ * lazy search also skips over the 1~2 bytes matches, so it walks the chain of the first byte,
+ * which visits the same candidates as the old window scan.
+ */
+
+#define LZ77_WINDOW 0x1000
+#define LZ77_MIN_LEN 3
+#define LZ77_MAX_LEN 18
+#define LZ77_HASH_BITS 12
+
+typedef struct lz77_finder_t {
+	const u8 *src;
+	u32 src_size;
+	u32 effort;
+	s32 head[1 << LZ77_HASH_BITS];
+	s32 prev[LZ77_WINDOW];
+	s32 head1[256]; // chain of first byte
+	s32 prev1[LZ77_WINDOW];
+	u32 cand[LZ77_WINDOW];
+} lz77_finder_t;
+
+static inline u32 lz77_hash(const u8 *p)
+{
+	return (p[0] | p[1] << 8 | p[2] << 16) * 0x9E3779B1u >> (32 - LZ77_HASH_BITS);
+}
+
+static void lz77_init(lz77_finder_t *F, const void *src, u32 src_size, u32 effort)
+{
+	F->src = src;
+	F->src_size = src_size;
+	F->effort = effort;
+	memset(F->head, -1, sizeof(F->head));
+	memset(F->head1, -1, sizeof(F->head1));
+}
+
+static void lz77_insert(lz77_finder_t *F, u32 pos)
+{
+	u8 c = F->src[pos];
+	F->prev1[pos & (LZ77_WINDOW - 1)] = F->head1[c];
+	F->head1[c] = pos;
+	if (pos + LZ77_MIN_LEN > F->src_size)
+		return;
+	u32 h = lz77_hash(F->src + pos);
+	F->prev[pos & (LZ77_WINDOW - 1)] = F->head[h];
+	F->head[h] = pos;
+}
+
+/**
+ * find the longest match at `pos`
+ * @param lazy skip candidates inside the last matched string
+ * @return     length of match (0 if not found), offset is saved to `*of`
+ */
+static u32 lz77_find(lz77_finder_t *F, u32 pos, bool lazy, u32 *of)
+{
+	if (pos + LZ77_MIN_LEN > F->src_size)
+		return 0;
+	const u8 *src = F->src, *p = src + pos;
+	u32 max = F->src_size - pos < LZ77_MAX_LEN ? F->src_size - pos : LZ77_MAX_LEN;
+	const s32 *prev = lazy ? F->prev1 : F->prev;
+	u32 n = 0;
+	for (s32 t = lazy ? F->head1[p[0]] : F->head[lz77_hash(p)]; t >= 0 && pos - t <= LZ77_WINDOW; t = prev[t & (LZ77_WINDOW - 1)]) {
+		F->cand[n++] = t;
+		if (n == F->effort)
+			break;
+	}
+	// chain is from near to far, but we try from far to near like a window scan
+	u32 len = 0, skip = 0;
+	while (n--) {
+		u32 t = F->cand[n];
+		if (t < skip)
+			continue;
+		u32 j = 0;
+		while (j < max && src[t + j] == p[j])
+			++j;
+		if (j > len) {
+			len = j;
+			*of = pos - t;
+			if (len == max) // cannot longer
+				break;
+		}
+		if (lazy)
+			skip = t + j + 1;
+	}
+	return len;
+}
+
 u32 LZ77Comp(void *dest, const void *src, u32 src_size, bool lazy)
 {
+	return LZ77CompEx(dest, src, src_size, lazy, LZ77_EFFORT_DEFAULT);
+}
+
+u32 LZ77CompEx(void *dest, const void *src, u32 src_size, bool lazy, u32 effort)
+{
+	lz77_finder_t *F = alloc(1, F);
+	if (!F)
+		return -1;
+	lz77_init(F, src, src_size, effort);
 	const u8 *p = src;
 	u8 *dest_org = dest;
 	*(u32*)dest = src_size << 8 | 0x10;
 	dest += 4;
-	while (IS_IN_RANGE(p)) {
+	u32 pos = 0;
+	while (pos < src_size) {
 		u8 f = 0; // flag
 		u8 *pf = dest++; // pointer of flag
-		for (int i = 7; IS_IN_RANGE(p) && i >= 0; --i) {
-			if (p == src) { // the first byte cannot appear before
-				*(u8*)dest++ = *p++;
-				continue;
-			}
-			// match
-			int len = 0, of;
-			for (const u8 *t = p - (u8*)src <= 0x1000 ? src : p - 0x1000; t < p; ++t) {
-				while (*t != *p)
-					++t;
-				if (t >= p) // cannot find
-					break;
-				const u8 *p_org = p, *t_org = t;
-				u8 j;
-				for (j = 0; j < 18 && IS_IN_RANGE(p) && *t == *p; ++j, ++t, ++p);
-				if (j > len) {
-					len = j;
-					of = p - t;
-				}
-				p = p_org; t = lazy ? t : t_org;
-			}
+		for (int i = 7; pos < src_size && i >= 0; --i) {
+			u32 of, len = lz77_find(F, pos, lazy, &of);
 			// encode
-			if (len < 3) { // raw
-				*(u8*)dest++ = *p++;
+			if (len < LZ77_MIN_LEN) { // raw
+				*(u8*)dest++ = p[pos];
+				len = 1;
 			} else { // offset + length
 				f |= 1 << i;
 				--of;
 				*(u16*)dest = (len - 3) << 4 | (of & 0xF00) >> 8 | (of & 0xFF) << 8;
 				dest += 2;
-				p += len;
 			}
+			while (len--)
+				lz77_insert(F, pos++);
 		}
 		*pf = f; // save flag
 	}
+	free(F);
 	return (u8*)dest - dest_org;
 }
 
-typedef struct {u32 f; short l, r;} node;
+/**
+ * optimal parse
+ * shortest path over (position, number of tokens mod 8), so the cost of flag bytes is exact:
+ * a token costs 1 (raw) or 2 (offset + length) bytes, plus 1 if it opens a new flag byte.
+ * matches are taken from a precomputed table (longest match of each position),
+ * any shorter length at the same offset is also a valid choice.
+ */
+u32 LZ77CompOpt(void *dest, const void *src, u32 src_size, u32 effort)
+{
+	const u8 *p = src;
+	u8 *dest_org = dest;
+	u32 n = src_size, size = -1;
+	lz77_finder_t *F = alloc(1, F);
+	u8 *mlen = alloc(n + 1, mlen); // longest match
+	u16 *mof = alloc(n + 1, mof); // offset of longest match
+	u32 *cost = alloc((n + 1) * 8, cost);
+	u8 *step = alloc((n + 1) * 8, step); // length of the token reaching the state
+	if (!F || !mlen || !mof || !cost || !step)
+		goto clean;
+	// match table
+	lz77_init(F, src, src_size, effort);
+	for (u32 pos = 0; pos < n; ++pos) {
+		u32 of = 0;
+		mlen[pos] = lz77_find(F, pos, false, &of);
+		mof[pos] = of;
+		lz77_insert(F, pos);
+	}
+	// shortest path
+	memset(cost, 0xFF, (n + 1) * 8 * sizeof(*cost));
+	cost[0] = 0;
+	for (u32 pos = 0; pos < n; ++pos) {
+		for (u32 k = 0; k < 8; ++k) {
+			u32 c = cost[pos * 8 + k];
+			if (c == UINT32_MAX)
+				continue;
+			c += !k; // new flag byte
+			u32 *pc = cost + (pos + 1) * 8 + ((k + 1) & 7); // state after a raw byte
+			if (c + 1 < *pc)
+				*pc = c + 1, step[pc - cost] = 1;
+			pc += 8 * (LZ77_MIN_LEN - 1);
+			for (u32 len = LZ77_MIN_LEN; len <= mlen[pos]; ++len, pc += 8) {
+				if (c + 2 < *pc)
+					*pc = c + 2, step[pc - cost] = len;
+			}
+		}
+	}
+	u32 k = 0;
+	for (u32 i = 1; i < 8; ++i)
+		if (cost[n * 8 + i] < cost[n * 8 + k])
+			k = i;
+	// trace back, save length of tokens to `mlen` from the end
+	u8 *tok = mlen + n;
+	for (u32 pos = n; pos; k = (k + 7) & 7) {
+		u8 len = step[pos * 8 + k];
+		*tok-- = len;
+		pos -= len;
+	}
+	// encode
+	*(u32*)dest = src_size << 8 | 0x10;
+	dest += 4;
+	u32 pos = 0;
+	while (pos < n) {
+		u8 f = 0; // flag
+		u8 *pf = dest++; // pointer of flag
+		for (int i = 7; pos < n && i >= 0; --i) {
+			u32 len = *++tok;
+			if (len == 1) { // raw
+				*(u8*)dest++ = p[pos];
+			} else { // offset + length
+				f |= 1 << i;
+				u32 of = mof[pos] - 1;
+				*(u16*)dest = (len - 3) << 4 | (of & 0xF00) >> 8 | (of & 0xFF) << 8;
+				dest += 2;
+			}
+			pos += len;
+		}
+		*pf = f; // save flag
+	}
+	size = (u8*)dest - dest_org;
+clean:
+	free(F);
+	free(mlen);
+	free(mof);
+	free(cost);
+	free(step);
+	return size;
+}
 
-static void heapify(node *a, short *x, int l, int r)
+/* sort used symbols by frequency, pad to 2 symbols for a valid tree, return the number */
+static u32 huff_sort(huff_work_t *W, u32 n)
 {
-	int p = l, c = p * 2 + 1;
-	while (c <= r) {
-		if (c + 1 <= r && a[x[c]].f > a[x[c + 1]].f)
-			++c;
-		if (a[x[p]].f <= a[x[c]].f)
-			return;
-		short t = x[p];
-		x[p] = x[c];
-		x[c] = t;
-		p = c, c = p * 2 + 1;
+	u32 m = 0;
+	for (u32 i = 0; i < n; ++i) {
+		if (!W->freq[i])
+			continue;
+		u32 j = m++;
+		for (; j && W->freq[W->sorted[j - 1]] > W->freq[i]; --j)
+			W->sorted[j] = W->sorted[j - 1];
+		W->sorted[j] = i;
+	}
+	for (u32 i = 0; m < 2; ++i) { // unused symbols come first with frequency 0
+		if (W->freq[i])
+			continue;
+		memmove(W->sorted + 1, W->sorted, m * sizeof(*W->sorted));
+		W->sorted[0] = i;
+		++m;
 	}
+	return m;
 }
 
-static void map_tree(node *a, int i, u32 *map, u8 *bmap)
+/* code length of sorted symbols, two-queue Huffman then limited as zlib does */
+static void huff_lengths(huff_work_t *W, u32 m, u32 *count)
 {
-	static u32 v;
-	static u8 b;
-	if (a[i].l == -1) {
-		int t = i;
-		map[t] = v;
-		bmap[t] = b;
-		return;
+	u32 *wt = W->weight;
+	for (u32 i = 0; i < m; ++i)
+		wt[i] = W->freq[W->sorted[i]];
+	for (u32 k = m, l = 0, q = m; k < 2 * m - 1; ++k) {
+		u32 c[2];
+		for (u32 j = 0; j < 2; ++j)
+			c[j] = l < m && (q == k || wt[l] <= wt[q]) ? l++ : q++;
+		wt[k] = wt[c[0]] + wt[c[1]];
+		W->parent[c[0]] = W->parent[c[1]] = k;
 	}
-	v <<= 1; ++b;
-	map_tree(a, a[i].l, map, bmap);
-	v |= 1;
-	map_tree(a, a[i].r, map, bmap);
-	v >>= 1; --b;
+	memset(count, 0, (HUFF_MAX_LEN + 1) * sizeof(*count));
+	s32 overflow = 0;
+	W->depth[2 * m - 2] = 0;
+	for (s32 i = 2 * m - 3; i >= 0; --i) {
+		u32 d = W->depth[W->parent[i]] + 1;
+		if (d > HUFF_MAX_LEN)
+			d = HUFF_MAX_LEN, ++overflow;
+		W->depth[i] = d;
+		if (i < m)
+			++count[d];
+	}
+	while (overflow > 0) { // move a leaf down, with an overflowed leaf as its brother
+		u32 d = HUFF_MAX_LEN - 1;
+		while (!count[d])
+			--d;
+		--count[d];
+		count[d + 1] += 2;
+		--count[HUFF_MAX_LEN];
+		overflow -= 2;
+	}
+	for (u32 d = HUFF_MAX_LEN, h = 0; d; --d) // the rarest get the longest
+		for (u32 i = 0; i < count[d]; ++i)
+			W->len[W->sorted[h++]] = d;
 }
 
-u32 HuffComp(void *dest, const void *src, u32 src_size, bool bmode)
+/* build tree level by level, leaves first, return the number of internal nodes */
+static u32 huff_build(huff_work_t *W, const u32 *count)
+{
+	u32 a = 0, b = 1; // internal nodes of this level
+	W->icode[0] = 0;
+	for (u32 d = 0; a < b; ++d) {
+		u32 sym = 0, leaves = count[d + 1], next = b;
+		for (u32 k = a; k < b; ++k) {
+			for (u32 c = 0; c < 2; ++c) {
+				u32 j = 2 * (k - a) + c, code = W->icode[k] << 1 | c;
+				if (j < leaves) { // leaf
+					while (W->len[sym] != d + 1 || !W->used[sym])
+						++sym;
+					W->code[sym] = code;
+					W->child[k][c] = 0x100 | sym++;
+				} else {
+					W->icode[next] = code;
+					W->child[k][c] = next++;
+				}
+			}
+		}
+		a = b;
+		b = next;
+	}
+	return b;
+}
+
+/**
+ * place children of every internal node in a pair at most 64 pairs after its own,
+ * go depth first to keep the frontier narrow, unless an older node would miss its pair
+ */
+static bool huff_layout(huff_work_t *W, u8 *tree, u32 internal)
+{
+	u16 *pend = W->pending, *pair = W->pair;
+	u32 npend = 1;
+	pend[0] = 0;
+	pair[0] = 0;
+	W->pos[0] = 1; // root
+	for (u32 q = 1; q < internal + 1; ++q) {
+		u32 t = npend - 1;
+		for (u32 i = 0; i < t; ++i) {
+			if (pair[pend[i]] + 64 < q + 1 + i) { // not feasible
+				t = 0;
+				break;
+			}
+		}
+		u32 k = pend[t];
+		if (pair[k] + 64 < q) // table is too large
+			return false;
+		memmove(pend + t, pend + t + 1, (--npend - t) * sizeof(*pend));
+		u8 v = q - pair[k] - 1;
+		for (u32 c = 0; c < 2; ++c) {
+			u32 x = W->child[k][c];
+			if (x & 0x100) { // leaf
+				tree[2 * q + c] = x;
+				v |= 0x80 >> c;
+			} else {
+				W->pos[x] = 2 * q + c;
+				pair[x] = q;
+				pend[npend++] = x;
+			}
+		}
+		tree[W->pos[k]] = v;
+	}
+	return true;
+}
+
+u32 HuffCompEx(void *dest, const void *src, u32 src_size, bool bmode, huff_work_t *W)
 {
 	const u8 *p = src;
 	u8 *dest_org = dest;
 	u8 bits = bmode ? 8 : 4;
 	*(u32*)dest = src_size << 8 | 0x20 | bits;
 	dest += 4;
-	int n = 1 << bits;
-	node a[511];
-	short x[256];
-	short cnt = 256;
-	// initialize
-	for (int i = 0; i < n; ++i)
-		a[i].f = 0, a[i].l = -1, x[i] = i;
+	u32 n = 1 << bits, count[HUFF_MAX_LEN + 1];
 	// read frequency
-	for (; IS_IN_RANGE(p); ++p)
-		++a[*p].f;
-	if (!bmode) { // 4-bit
-		u32 b[16] = {};
-		for (int i = 0; i < 256; ++i) {
-			b[i >> 4] += a[i].f;
-			b[i & 0xF] += a[i].f;
+	memset(W->freq, 0, sizeof(W->freq));
+	for (; IS_IN_RANGE(p); ++p) {
+		if (bmode) {
+			++W->freq[*p];
+		} else {
+			++W->freq[*p & 0xF];
+			++W->freq[*p >> 4];
 		}
-		for (int i = 0; i < 16; ++i)
-			a[i].f = b[i];
 	}
 	// build tree
-	for (int i = n / 2 - 1; i >= 0; --i)
-		heapify(a, x, i, n - 1);
-	while (a[x[0]].f == 0) { // discard unused char
-		x[0] = x[--n];
-		heapify(a, x, 0, n - 1);
-	}
-	int i, j;
-	while (n && (i = x[0], x[0] = x[--n], heapify(a, x, 0, n - 1), n)) {
-		j = x[0];
-		a[cnt].f = a[i].f + a[j].f;
-		a[cnt].l = j;
-		a[cnt].r = i;
-		x[0] = cnt++;
-		heapify(a, x, 0, n - 1);
-	}
-	// save tree
+	u32 m = huff_sort(W, n);
+	memset(W->used, 0, sizeof(W->used));
+	for (u32 i = 0; i < m; ++i)
+		W->used[W->sorted[i]] = true;
+	huff_lengths(W, m, count);
+	u32 internal = huff_build(W, count);
+	// save tree, data must be word aligned
 	u8 *tree = dest;
-	*(u8*)dest++ = cnt - 256; // size
-	short q[511], *qh = q, *qt = q;
-	*qt++ = cnt - 1; // root
-	for (int c = 0; qh < qt;) { // layer by layer
-		i = *qh++;
-		if (a[i].l == -1) {
-			*(u8*)dest++ = i;
-			--c;
-			continue;
-		}
-		if (c >= 0x80) // table is too large
-			return -1;
-		*(u8*)dest++ = c++ >> 1 | (a[i].l < 256) << 7 | (a[i].r < 256) << 6;
-		*qt++ = a[i].l;
-		*qt++ = a[i].r;
-	}
-	// preprocess, create encode array
-	u32 map[256]; // easy to prove length <= 32
-	u8 bmap[256]; // code length
-	map_tree(a, cnt - 1, map, bmap);
-	// encode
-	p = src;
-	u32 *dest32 = (u32*)(tree + ((cnt - 255) << 1));
-	u32 v = 0;
-	i = 0x20;
-	while (IS_IN_RANGE(p)) {
-		u8 t = *p++;
-		for (int j = 0; j < 8; j += bits, t >>= bits) {
-			u8 b = t & ((1 << bits) - 1);
-			if (i < bmap[b]) { // need next word
-				*dest32++ = v | map[b] >> (bmap[b] - i);
-				i += 0x20 - bmap[b];
-				v = map[b] << i;
-			} else {
-				i -= bmap[b];
-				v |= map[b] << i;
+	u32 tree_size = internal | 1;
+	memset(tree, 0, (tree_size + 1) << 1);
+	tree[0] = tree_size;
+	if (!huff_layout(W, tree, internal))
+		return -1;
+	// encode, MSB first
+	u32 *dest32 = (u32*)(tree + ((tree_size + 1) << 1));
+	u64 v = 0;
+	u32 nv = 0;
+	for (p = src; IS_IN_RANGE(p); ++p) {
+		u8 t = *p;
+		for (u32 j = 0; j < 8; j += bits, t >>= bits) {
+			u8 b = t & (n - 1);
+			v = v << W->len[b] | W->code[b];
+			nv += W->len[b];
+			if (nv >= 32) {
+				nv -= 32;
+				*dest32++ = v >> nv;
 			}
 		}
 	}
-	*dest32++ = v;
+	*dest32++ = v << (32 - nv);
 	return (u8*)dest32 - dest_org;
 }
 
+u32 HuffComp(void *dest, const void *src, u32 src_size, bool bmode)
+{
+	huff_work_t W;
+	return HuffCompEx(dest, src, src_size, bmode, &W);
+}
+
 /* uncompress */
 
 /**
@@ -317,6 +642,113 @@ void RLUnComp(void *dest, const void *src, u32 *psize)
 	}
 }
 
+/**
+ * the same as `RLUnComp`, but runs are filled by `memset`/`memcpy`,
+ * and output never goes beyond `*psize`
+ */
+void RLUnCompFast(void *dest, const void *src, u32 *psize)
+{
+	int size;
+	CHECK_BUF();
+	const u8 *psrc = src + 4;
+	u8 *pdest = dest, *end = pdest + size;
+	*psize = size;
+	while (pdest < end) {
+		u8 b = *psrc++;
+		u32 len = b & 0x7F, rest = end - pdest;
+		if (b & 0x80) { // duplicate bytes
+			len += 3;
+			memset(pdest, *psrc++, len < rest ? len : rest);
+		} else {
+			len += 1;
+			memcpy(pdest, psrc, len < rest ? len : rest);
+			psrc += len;
+		}
+		pdest += len < rest ? len : rest;
+	}
+}
+
+/**
+ * Huffman decoder
+ * a lookup table indexed by the next HUFF_LUT_BITS bits of stream gives all the symbols
+ * completed within these bits (at most 32 bits of symbols, the same layout as output),
+ * codes longer than that continue walking the tree bit by bit from the node reached.
+ * stream words are prefetched only if they must exist, so we never read past the stream.
+ * unlike BIOS, padding of the last output word is zero.
+ */
+
+#define HUFF_LUT_BITS 10
+
+typedef struct huff_dec_t {
+	const u8 *tree, *tree_end;
+	const u32 *p; // data
+	u64 bb; // bit buffer, MSB first
+	int nb; // bits in buffer
+	u8 bits; // bits of symbol
+	const u32 *p_end; // end of data, NULL if not known
+	bool over; // data ran out
+} huff_dec_t;
+
+static inline const u8 *huff_child(const u8 *q, u32 f)
+{
+	return (u8*)((uintptr_t)q & ~1) + (((*q & 0x3F) + 1) << 1) + f;
+}
+
+/* walk tree from `q` bit by bit, only read the next word when it is needed */
+static u32 huff_walk(huff_dec_t *D, const u8 *q)
+{
+	while (1) {
+		if (!D->nb) {
+			if (D->p == D->p_end) {
+				D->over = true;
+				return 0;
+			}
+			D->bb = (u64)*D->p++ << 32;
+			D->nb = 32;
+		}
+		u32 f = D->bb >> 63;
+		u8 b = *q << f;
+		D->bb <<= 1;
+		--D->nb;
+		q = huff_child(q, f);
+		if (q >= D->tree_end) // broken tree
+			return 0;
+		if (b & 0x80) // is leaf
+			return *q & ((1 << D->bits) - 1);
+	}
+}
+
+/* build table, return length of the shortest code */
+static u32 huff_build_lut(huff_lut_t *lut, u32 lut_bits, const u8 *tree, const u8 *tree_end, u8 bits)
+{
+	const u8 *root = tree + 1;
+	u32 max_sym = 32 / bits, min_len = lut_bits + 1;
+	for (u32 v = 0; v < 1u << lut_bits; ++v) {
+		const u8 *q = root;
+		u32 syms = 0, nsym = 0, used = 0;
+		for (u32 i = 0; i < lut_bits; ++i) {
+			u32 f = v >> (lut_bits - 1 - i) & 1;
+			u8 b = *q << f;
+			q = huff_child(q, f);
+			bool broken = q >= tree_end; // the same as `huff_walk`
+			if (broken || (b & 0x80)) { // is leaf
+				if (!nsym && i + 1 < min_len)
+					min_len = i + 1;
+				syms |= (u32)(broken ? 0 : *q & ((1 << bits) - 1)) << nsym * bits;
+				used = i + 1;
+				q = root;
+				if (++nsym == max_sym)
+					break;
+			}
+		}
+		if (nsym)
+			lut[v] = (huff_lut_t){.syms = syms, .nsym = nsym, .nbits = used};
+		else
+			lut[v] = (huff_lut_t){.nbits = lut_bits, .node = q - tree};
+	}
+	return min_len;
+}
+
 void HuffUnComp(void *dest, const void *src, u32 *psize)
 {
 	int size;
@@ -325,31 +757,58 @@ void HuffUnComp(void *dest, const void *src, u32 *psize)
 	u32 *pdest = dest;
 	*psize = size;
 	const u8 *tree = psrc + 4;
-	const u8 *root = tree + 1;
 	u8 bits = *psrc & 0xF; // bits num once
-	u8 n = (bits & 7) + 4;
-	u32 *p = (u32*)(tree + ((*tree + 1) << 1)); // data
-	const u8 *q = root;
-	u8 cnt = 0;
-	while (size > 0) {
-		u32 v = *p++, t;
-		for (int i = 0x20; --i >= 0; v <<= 1) {
-			u8 f = v >> 0x1F;
-			u8 b = *q << f;
-			q = (u8*)((uintptr_t)q & ~1) + (((*q & 0x3F) + 1) << 1) + f; // query tree
-			if (b & 0x80) { // is leaf
-				t = t >> bits | *q << (0x20 - bits);
-				q = root;
-				if (++cnt == n) {
-					*pdest++ = t;
-					size -= 4;
-					cnt = 0;
-					if (size <= 0)
-						return;
-				}
+	if (bits != 4 && bits != 8) {
+		*psize = 0;
+		return;
+	}
+	huff_dec_t D = {
+		.tree = tree,
+		.tree_end = tree + ((*tree + 1) << 1),
+		.p = (u32*)(tree + ((*tree + 1) << 1)), // data
+		.bits = bits
+	};
+	huff_lut_t lut[1 << HUFF_LUT_BITS];
+	u32 min_len = huff_build_lut(lut, HUFF_LUT_BITS, tree, D.tree_end, bits);
+	u32 rem = size << (bits == 4); // remaining symbols, padding of the last word is not decoded
+	u64 t = 0; // output bits
+	int nt = 0;
+	while (rem) {
+		if (D.nb <= 32 && rem * min_len > D.nb) { // the next word must exist
+			D.bb |= (u64)*D.p++ << (32 - D.nb);
+			D.nb += 32;
+		}
+		u32 syms, n;
+		if (D.nb >= HUFF_LUT_BITS) {
+			huff_lut_t e = lut[D.bb >> (64 - HUFF_LUT_BITS)];
+			D.bb <<= e.nbits;
+			D.nb -= e.nbits;
+			if (e.nsym) {
+				syms = e.syms;
+				n = e.nsym;
+			} else { // long code
+				syms = huff_walk(&D, tree + e.node);
+				n = 1;
 			}
+		} else {
+			syms = huff_walk(&D, tree + 1);
+			n = 1;
+		}
+		if (n > rem) {
+			n = rem;
+			syms &= (1 << n * bits) - 1;
+		}
+		t |= (u64)syms << nt;
+		nt += n * bits;
+		rem -= n;
+		if (nt >= 32) {
+			*pdest++ = t;
+			t >>= 32;
+			nt -= 32;
 		}
 	}
+	if (nt)
+		*pdest = t;
 }
 
 void LZ77UnComp(void *dest, const void *src, u32 *psize)
@@ -380,6 +839,107 @@ void LZ77UnComp(void *dest, const void *src, u32 *psize)
 	}
 }
 
+/**
+ * the same as `LZ77UnComp`, but
+ * a flag of 8 raw bytes is copied at once,
+ * a match is copied by 8 bytes if offset >= 8, or replicated from its first 8 bytes if offset < 8.
+ * wide copies may write up to 7 bytes beyond the match, so they are only used
+ * if there are at least 24 bytes left, output never goes beyond `*psize`
+ */
+void LZ77UnCompFast(void *dest, const void *src, u32 *psize)
+{
+	int size;
+	CHECK_BUF();
+	const u8 *psrc = src + 4;
+	u8 *pdest = dest, *end = pdest + size;
+	*psize = size;
+	while (pdest < end) {
+		u8 f = *psrc++; // flag
+		if (!f && end - pdest >= 8) { // raw * 8
+			memcpy(pdest, psrc, 8);
+			pdest += 8;
+			psrc += 8;
+			continue;
+		}
+		for (int i = 7; i >= 0 && pdest < end; --i, f <<= 1) {
+			if (!(f & 0x80)) { // raw
+				*pdest++ = *psrc++;
+				continue;
+			}
+			// offset + length
+			u32 len = (psrc[0] >> 4) + 3;
+			u32 of = ((psrc[0] & 0xF) << 8 | psrc[1]) + 1;
+			psrc += 2;
+			const u8 *from = pdest - of;
+			if (end - pdest < 24) { // safe tail
+				if (len > end - pdest)
+					len = end - pdest;
+				while (len--)
+					*pdest++ = *from++;
+				continue;
+			}
+			if (of == 1) {
+				memset(pdest, *from, len);
+			} else if (of < 8) {
+				u32 step = of * ((8 + of - 1) / of); // period >= 8
+				for (int k = 0; k < 8; ++k)
+					pdest[k] = from[k];
+				for (u32 k = 8; k < len; k += 8)
+					memcpy(pdest + k, pdest + k - step, 8);
+			} else {
+				for (u32 k = 0; k < len; k += 8)
+					memcpy(pdest + k, from + k, 8);
+			}
+			pdest += len;
+		}
+	}
+}
+
+/**
+ * the same as `LZ77UnComp`, for untrusted data: input never goes beyond `src_size`,
+ * and a match never refers before `dest`.
+ * *psize is the size of `dest`, and is set to the uncompressed size.
+ * return false if data is not LZ77, too large, truncated or refers before the output
+ */
+bool LZ77UnCompSafe(void *dest, const void *src, u32 src_size, u32 *psize)
+{
+	if (src_size < 4 || (*(u8*)src & 0xF0) != 0x10)
+		return false;
+	u32 size = *(u32*)src >> 8;
+	if (size > *psize)
+		return false;
+	*psize = size;
+	const u8 *psrc = src + 4, *src_end = src + src_size;
+	u8 *pdest = dest, *end = pdest + size;
+	while (pdest < end) {
+		if (psrc == src_end)
+			return false;
+		u8 f = *psrc++; // flag
+		for (int i = 7; i >= 0 && pdest < end; --i, f <<= 1) {
+			if (!(f & 0x80)) { // raw
+				if (psrc == src_end)
+					return false;
+				*pdest++ = *psrc++;
+				continue;
+			}
+			// offset + length
+			if (src_end - psrc < 2)
+				return false;
+			u32 len = (psrc[0] >> 4) + 3;
+			u32 of = ((psrc[0] & 0xF) << 8 | psrc[1]) + 1;
+			psrc += 2;
+			if (of > pdest - (u8*)dest)
+				return false;
+			if (len > end - pdest)
+				len = end - pdest;
+			const u8 *from = pdest - of;
+			while (len--)
+				*pdest++ = *from++;
+		}
+	}
+	return true;
+}
+
 void BareUnComp(void *dest, const void *src, u32 *psize)
 {
 	int size;
@@ -388,6 +948,248 @@ void BareUnComp(void *dest, const void *src, u32 *psize)
 	memcpy(dest, src + 4, size);
 }
 
+///////////////
+// streaming //
+///////////////
+
+#define STREAM_MASK (STREAM_WINDOW - 1)
+
+/* for decoders: true if `n` more bytes of input exist, otherwise the stream fails */
+bool uncomp_stream_need(uncomp_stream_t *S, u32 n)
+{
+	if (!S->src_end || S->src_end - S->src >= n)
+		return true;
+	S->error = S->end = true;
+	return false;
+}
+
+static void stream_next_bare(uncomp_stream_t *S)
+{
+	S->op = STREAM_OP_RAW;
+	S->len = S->size;
+}
+
+static void stream_next_rl(uncomp_stream_t *S)
+{
+	if (!uncomp_stream_need(S, 1))
+		return;
+	u8 b = *S->src++;
+	if (b & 0x80) { // duplicate bytes
+		if (!uncomp_stream_need(S, 1))
+			return;
+		S->op = STREAM_OP_FILL;
+		S->len = (b & 0x7F) + 3;
+		S->b = *S->src++;
+	} else {
+		S->op = STREAM_OP_RAW;
+		S->len = b + 1;
+	}
+}
+
+static void stream_next_lz77(uncomp_stream_t *S)
+{
+	if (!S->lz.nflags) {
+		if (!uncomp_stream_need(S, 1))
+			return;
+		S->lz.flags = *S->src++;
+		S->lz.nflags = 8;
+	}
+	if (S->lz.flags & 0x80) { // offset + length
+		if (!uncomp_stream_need(S, 2))
+			return;
+		u8 b = *S->src++;
+		S->op = STREAM_OP_COPY;
+		S->len = (b >> 4) + 3;
+		S->of = (*S->src++ | (b & 0xF) << 8) + 1;
+	} else { // raw
+		S->op = STREAM_OP_RAW;
+		S->len = 1;
+	}
+	S->lz.flags <<= 1;
+	--S->lz.nflags;
+}
+
+/* run the pending operation into `dest`, return bytes written */
+static u32 stream_run(uncomp_stream_t *S, u8 *dest, u32 size)
+{
+	u32 n = S->len;
+	if (n > size)
+		n = size;
+	if (n > S->size - S->done)
+		n = S->size - S->done;
+	if (S->op == STREAM_OP_RAW && S->src_end && n > S->src_end - S->src) { // input runs out
+		n = S->src_end - S->src;
+		if (!n) {
+			S->error = S->end = true;
+			return 0;
+		}
+	}
+	u32 pos = S->done;
+	if (S->kind == STREAM_KIND_PLAIN) { // never copied from, so no window
+		if (S->op == STREAM_OP_RAW) {
+			memcpy(dest, S->src, n);
+			S->src += n;
+		} else {
+			memset(dest, S->b, n);
+		}
+		S->done += n;
+		S->len -= n;
+		return n;
+	}
+	switch (S->op) {
+		case STREAM_OP_RAW:
+			for (u32 i = 0; i < n; ++i)
+				S->lz.window[pos++ & STREAM_MASK] = dest[i] = *S->src++;
+			break;
+		case STREAM_OP_FILL:
+			memset(dest, S->b, n);
+			for (u32 i = 0; i < n; ++i)
+				S->lz.window[pos++ & STREAM_MASK] = S->b;
+			break;
+		case STREAM_OP_COPY:
+			for (u32 i = 0; i < n; ++i, ++pos)
+				S->lz.window[pos & STREAM_MASK] = dest[i] = S->lz.window[(pos - S->of) & STREAM_MASK];
+			break;
+	}
+	S->done = pos;
+	S->len -= n;
+	return n;
+}
+
+/* decode Huffman symbols straight into `dest`, return bytes written, the same as `HuffUnComp` otherwise */
+static u32 stream_run_huff(uncomp_stream_t *S, u8 *dest, u32 size)
+{
+	const huff_lut_t *lut = S->huff.lut;
+	const u8 *tree = S->huff.tree;
+	huff_dec_t D = {
+		.tree = tree,
+		.tree_end = tree + ((*tree + 1) << 1),
+		.p = (const u32*)S->src,
+		.bb = S->huff.bb,
+		.nb = S->huff.nb,
+		.bits = S->huff.bits,
+		.p_end = S->src_end ? (const u32*)(S->src + ((S->src_end - S->src) & ~3)) : NULL // whole words
+	};
+	u32 bits = S->huff.bits, min_len = S->huff.min_len;
+	u32 n = S->size - S->done;
+	if (n > size)
+		n = size;
+	u32 rem = ((S->size - S->done) << (bits == 4)) - S->huff.nout / bits; // symbols not decoded
+	u64 t = S->huff.out;
+	int nt = S->huff.nout;
+	u32 i = 0;
+	while (1) {
+		for (; nt >= 8 && i < n; nt -= 8, t >>= 8)
+			dest[i++] = t;
+		if (i == n || !rem)
+			break;
+		if (D.nb <= 32 && rem * min_len > D.nb) { // the next word must exist
+			if (D.p == D.p_end) {
+				D.over = true;
+				break;
+			}
+			D.bb |= (u64)*D.p++ << (32 - D.nb);
+			D.nb += 32;
+		}
+		u32 syms, k;
+		if (D.nb >= STREAM_LUT_BITS) {
+			huff_lut_t e = lut[D.bb >> (64 - STREAM_LUT_BITS)];
+			D.bb <<= e.nbits;
+			D.nb -= e.nbits;
+			if (e.nsym) {
+				syms = e.syms;
+				k = e.nsym;
+			} else { // long code
+				syms = huff_walk(&D, tree + e.node);
+				k = 1;
+			}
+		} else {
+			syms = huff_walk(&D, tree + 1);
+			k = 1;
+		}
+		if (D.over)
+			break;
+		if (k > rem) {
+			k = rem;
+			syms &= (1 << k * bits) - 1;
+		}
+		t |= (u64)syms << nt;
+		nt += k * bits;
+		rem -= k;
+	}
+	S->huff.out = t;
+	S->huff.nout = nt;
+	S->src = (const u8*)D.p;
+	S->huff.bb = D.bb;
+	S->huff.nb = D.nb;
+	S->done += i;
+	if (D.over)
+		S->error = S->end = true;
+	return i;
+}
+
+void uncomp_stream_init(uncomp_stream_t *S, const void *src, u32 src_size)
+{
+	static const struct {
+		StreamKind kind;
+		void (*next)(uncomp_stream_t*);
+	} table[] = {
+		[CompressModeBare] = {STREAM_KIND_PLAIN, stream_next_bare},
+		[CompressModeLZ77] = {STREAM_KIND_WINDOW, stream_next_lz77},
+		[CompressModeHuff] = {STREAM_KIND_HUFF, NULL},
+		[CompressModeRL] = {STREAM_KIND_PLAIN, stream_next_rl}
+	};
+	*S = (uncomp_stream_t){
+		.src = src,
+		.src_end = src_size == (u32)-1 ? NULL : src + src_size
+	};
+	if (!uncomp_stream_need(S, 4))
+		return;
+	u32 head = *(u32*)src;
+	u8 type = head & 0xFF, bits = head & 0xF;
+	S->src += 4;
+	S->size = head >> 8;
+	if (type >= 0x40 || (type >> 4 == CompressModeHuff && bits != 4 && bits != 8)) { // invalid type
+		S->size = 0;
+		S->error = S->end = true;
+		return;
+	}
+	S->kind = table[type >> 4].kind;
+	S->next = table[type >> 4].next;
+	switch (S->kind) {
+		case STREAM_KIND_WINDOW:
+			memset(S->lz.window, 0, sizeof(S->lz.window));
+			break;
+		case STREAM_KIND_HUFF:
+			if (!uncomp_stream_need(S, 1) || !uncomp_stream_need(S, (*S->src + 1) << 1))
+				return;
+			S->huff.tree = S->src;
+			S->huff.bits = bits;
+			S->src += (*S->huff.tree + 1) << 1; // data
+			S->huff.min_len = huff_build_lut(S->huff.lut, STREAM_LUT_BITS, S->huff.tree, S->src, bits);
+			break;
+		default:
+			break;
+	}
+	S->end = !S->size;
+}
+
+u32 uncomp_stream_read(uncomp_stream_t *S, void *dest, u32 size)
+{
+	u32 n = 0;
+	while (n < size && !S->end) {
+		if (S->kind == STREAM_KIND_HUFF)
+			n += stream_run_huff(S, (u8*)dest + n, size - n);
+		else if (S->len)
+			n += stream_run(S, (u8*)dest + n, size - n);
+		else
+			S->next(S);
+		if (S->done == S->size)
+			S->end = true;
+	}
+	return n;
+}
+
 ////////////
 // sprite //
 ////////////
@@ -21,6 +21,7 @@ typedef u32 vp_t; /* virtual pointer */
 
 extern u8 *ROM;
 extern u32 ROM_size;
+extern u32 ROM_version;
 
 extern u8 *PRAM, *VRAM, *OAM;
 
@@ -56,17 +57,48 @@ extern u8 *PRAM, *VRAM, *OAM;
 
 /* I/O */
 
+#define ROM_PAGE_SIZE 0x1000 /* granularity of modifications of mapped ROM */
+
 bool load_ROM(const char *name);
+bool map_ROM(const char *name);
 void free_ROM(void);
 void write_ROM(const char *name);
+void mark_ROM(u32 offset, u32 size);
+bool resize_ROM(u32 size);
 bool check_ROM_pointer(u32 P);
 
 /* BIOS */
 
+/* LZ77 effort: max candidates tried per byte, 0 for full window search (same output as a window scan) */
+#define LZ77_EFFORT_DEFAULT 128
+
+/* Huffman: longest code */
+#define HUFF_MAX_LEN 20
+
+/* workspace of HuffCompEx, one per thread */
+typedef struct huff_work_t {
+	u32 freq[256];
+	u16 sorted[256]; // used symbols, rarest first
+	bool used[256];
+	u8 len[256]; // code length
+	u32 code[256];
+	u32 weight[511]; // leaves then internal nodes
+	u16 parent[511];
+	u8 depth[511];
+	u16 child[256][2]; // of internal nodes, 0x100 | symbol if leaf
+	u32 icode[256]; // code of internal nodes
+	u16 pos[256]; // byte of internal nodes in tree
+	u16 pair[256]; // pair of internal nodes in tree
+	u16 pending[256]; // internal nodes without children placed
+} huff_work_t;
+
 u32 BareComp(void *dest, const void *src, u32 src_size);
 u32 RLComp(void *dest, const void *src, u32 src_size);
 u32 LZ77Comp(void *dest, const void *src, u32 src_size, bool lazy);
+u32 LZ77CompEx(void *dest, const void *src, u32 src_size, bool lazy, u32 effort);
+u32 LZ77CompOpt(void *dest, const void *src, u32 src_size, u32 effort);
 u32 HuffComp(void *dest, const void *src, u32 src_size, bool bmode);
+u32 HuffCompEx(void *dest, const void *src, u32 src_size, bool bmode, huff_work_t *W);
 #define HuffComp8(dest,src,src_size) HuffComp(dest, src, src_size, true)
 #define HuffComp4(dest,src,src_size) HuffComp(dest, src, src_size, false)
 
@@ -74,6 +106,74 @@ void BareUnComp(void *dest, const void *src, u32 *psize);
 void RLUnComp(void *dest, const void *src, u32 *psize);
 void LZ77UnComp(void *dest, const void *src, u32 *psize);
 void HuffUnComp(void *dest, const void *src, u32 *psize);
+void RLUnCompFast(void *dest, const void *src, u32 *psize);
+void LZ77UnCompFast(void *dest, const void *src, u32 *psize);
+bool LZ77UnCompSafe(void *dest, const void *src, u32 src_size, u32 *psize);
+
+/* streaming uncompress: output in chunks of any size, resumable, memory is fixed */
+#define STREAM_WINDOW 0x1000 /* ring window, the longest distance of LZ77 and Koei LZ77 */
+
+#define STREAM_LUT_BITS 9 /* Huffman lookup table, codes up to this length are decoded at once */
+
+typedef enum StreamKind {
+	STREAM_KIND_PLAIN, // Bare, RL: operations are output as they are
+	STREAM_KIND_WINDOW, // LZ77, Koei LZ77: output is kept in the window for copies
+	STREAM_KIND_HUFF // Huffman: no operations, symbols are decoded straight into the output
+} StreamKind;
+
+enum {
+	STREAM_OP_RAW, // copy from input
+	STREAM_OP_FILL, // repeat `b`
+	STREAM_OP_COPY // copy from window at distance `of`
+};
+
+/* entry of Huffman lookup table */
+typedef struct huff_lut_t {
+	u32 syms; // symbols, the first is the lowest
+	u8 nsym; // number of symbols, 0 if no code ends in the table bits
+	u8 nbits; // bits used
+	u16 node; // offset of node from tree (if nsym is 0)
+} huff_lut_t;
+
+typedef struct uncomp_stream_t uncomp_stream_t;
+struct uncomp_stream_t {
+	StreamKind kind;
+	void (*next)(uncomp_stream_t *S); // decode the next operation, or set `end`, NULL for Huffman
+	const u8 *src; // next input
+	const u8 *src_end; // end of input, NULL if not known
+	u32 size; // uncompressed size, -1 if unknown until the end
+	u32 done; // bytes produced
+	bool end; // no more output
+	bool error; // input is invalid or ran out, output is incomplete
+	// pending operation
+	u8 op; // STREAM_OP_*
+	u8 b; // byte to fill
+	u32 len; // bytes left
+	u32 of; // distance of copy
+	union {
+		struct { // LZ77, Koei LZ77
+			u32 flags; // flag bits, MSB first
+			u32 nflags;
+			u64 bb; // Koei: bit reader, MSB first
+			int nb;
+			u8 window[STREAM_WINDOW]; // the last output, copied from
+		} lz;
+		struct { // Huffman
+			const u8 *tree;
+			u8 bits; // of symbol
+			u8 min_len; // of code
+			u64 bb; // bit reader, MSB first
+			int nb;
+			u64 out; // symbols decoded but not output yet, the first is the lowest
+			int nout; // bits in `out`
+			huff_lut_t lut[1 << STREAM_LUT_BITS];
+		} huff;
+	};
+};
+
+void uncomp_stream_init(uncomp_stream_t *S, const void *src, u32 src_size); // src_size: readable bytes, -1 if not known
+u32 uncomp_stream_read(uncomp_stream_t *S, void *dest, u32 size);
+bool uncomp_stream_need(uncomp_stream_t *S, u32 n);
 
 typedef enum GBACompressMode {
 	CompressModeBare,
@@ -2,13 +2,226 @@
 #include "gba.h"
 #include "utils/io.h"
 #include "utils/logger.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 #include <string.h>
 
-u32 koei_compress(void *dest, const void *src, u32 src_size, bool extra)
+//////////
+// auto //
+//////////
+
+#define AUTO_THREADS 4
+#define AUTO_HASH_SIZE 0x1000
+
+typedef struct trial_t {
+	u32 (*comp)(void *dest, const void *src, u32 src_size, u32 arg);
+	u32 arg;
+	u32 bound; // max packed size
+	u8 *buf;
+	u32 size; // packed size, -1 if failed
+} trial_t;
+
+typedef struct auto_t {
+	const void *src;
+	u32 src_size;
+	trial_t *trials;
+	u32 num;
+	atomic_uint next; // next trial to run
+} auto_t;
+
+static u32 trial_rl(void *dest, const void *src, u32 src_size, u32 arg) { return RLComp(dest, src, src_size); }
+static u32 trial_lz77(void *dest, const void *src, u32 src_size, u32 arg) { return LZ77Comp(dest, src, src_size, arg); }
+static u32 trial_lz77_opt(void *dest, const void *src, u32 src_size, u32 arg) { return LZ77CompOpt(dest, src, src_size, arg); }
+static u32 trial_huff(void *dest, const void *src, u32 src_size, u32 arg) { return HuffComp(dest, src, src_size, arg); }
+
+static void auto_worker(auto_t *A)
+{
+	for (u32 i; (i = atomic_fetch_add(&A->next, 1)) < A->num; ) {
+		trial_t *T = &A->trials[i];
+		T->buf = malloc(T->bound);
+		T->size = T->buf ? T->comp(T->buf, A->src, A->src_size, T->arg) : (u32)-1;
+	}
+}
+
+/**
+ * helper threads are started by the first call and kept, later calls only wake them.
+ * one call uses them at a time, a concurrent call runs its trials alone.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work; // a job is posted
+	pthread_cond_t idle; // no helper is in the job
+	auto_t *job; // NULL if none
+	u32 gen; // of job, so a helper joins each job once
+	u32 busy; // helpers in the job
+	u32 num; // helpers started
+} Pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *auto_helper(void *arg)
+{
+	u32 gen = 0;
+	pthread_mutex_lock(&Pool.lock);
+	while (1) {
+		while (!Pool.job || Pool.gen == gen)
+			pthread_cond_wait(&Pool.work, &Pool.lock);
+		gen = Pool.gen;
+		auto_t *A = Pool.job;
+		++Pool.busy;
+		pthread_mutex_unlock(&Pool.lock);
+		auto_worker(A);
+		pthread_mutex_lock(&Pool.lock);
+		if (!--Pool.busy)
+			pthread_cond_signal(&Pool.idle);
+	}
+	return NULL;
+}
+
+/* run all trials, with the helpers unless they are taken */
+static void auto_run(auto_t *A)
+{
+	pthread_mutex_lock(&Pool.lock);
+	bool pooled = !Pool.job;
+	if (pooled) {
+		pthread_t t;
+		while (Pool.num < AUTO_THREADS - 1 && !pthread_create(&t, NULL, auto_helper, NULL)) {
+			pthread_detach(t);
+			++Pool.num;
+		}
+		Pool.job = A;
+		++Pool.gen;
+		pthread_cond_broadcast(&Pool.work);
+	}
+	pthread_mutex_unlock(&Pool.lock);
+	auto_worker(A); // the calling thread works too
+	if (pooled) {
+		pthread_mutex_lock(&Pool.lock);
+		while (Pool.busy)
+			pthread_cond_wait(&Pool.idle, &Pool.lock);
+		Pool.job = NULL;
+		pthread_mutex_unlock(&Pool.lock);
+	}
+}
+
+/**
+ * entropy of a histogram in bits
+ */
+static double entropy(const u32 *hist, u32 n, u32 total)
+{
+	double e = 0;
+	for (u32 i = 0; i < n; ++i)
+		if (hist[i])
+			e -= hist[i] * log2((double)hist[i] / total);
+	return e;
+}
+
+/**
+ * cheap lower bounds of each mode, a mode is hopeless if it cannot beat Bare (src_size + 4)
+ */
+static void auto_filter(const u8 *src, u32 src_size, bool *rl, bool *lz77, bool *huff4, bool *huff8)
+{
+	u32 hist[256] = {}, hist4[16] = {};
+	u32 saved = 0; // bytes saved by runs of 3+
+	for (u32 i = 0, j; i < src_size; i = j) {
+		for (j = i; j < src_size && src[j] == src[i]; ++j)
+			++hist[src[i]];
+		if (j - i >= 3)
+			saved += j - i - 2;
+	}
+	for (u32 i = 0; i < 256; ++i) {
+		hist4[i & 0xF] += hist[i];
+		hist4[i >> 4] += hist[i];
+	}
+	// Huffman cannot go below entropy, the tree takes 2 bytes at least
+	*huff8 = 6 + entropy(hist, 256, src_size) / 8 < src_size + 4;
+	*huff4 = 6 + entropy(hist4, 16, src_size * 2) / 8 < src_size + 4;
+	// only runs make RL shorter than Bare
+	*rl = saved > 0;
+	// a position without a 3-byte repeat in window is a literal, costing 9/8 byte
+	// (approximate: hash collisions may hide a repeat)
+	s32 *head = malloc(AUTO_HASH_SIZE * sizeof(*head));
+	if (!head) {
+		*lz77 = true;
+		return;
+	}
+	memset(head, -1, AUTO_HASH_SIZE * sizeof(*head));
+	u32 hits = 0;
+	for (u32 i = 0; i + 3 <= src_size; ++i) {
+		u32 h = (src[i] << 8 ^ src[i + 1] << 4 ^ src[i + 2]) & (AUTO_HASH_SIZE - 1);
+		s32 j = head[h];
+		if (j >= 0 && i - j <= 0x1000 && !memcmp(src + i, src + j, 3))
+			++hits;
+		head[h] = i;
+	}
+	free(head);
+	// a match saves at most 9/8 byte per covered byte, and covers at most 3 bytes per hit
+	*lz77 = hits * 27 >= src_size;
+}
+
+/**
+ * try every mode concurrently (or in turn with KOEI_COMP_INLINE), keep the smallest
+ */
+static u32 auto_compress(void *dest, const void *src, u32 src_size, u32 flags)
 {
+	bool rl = true, lz77 = true, huff4 = true, huff8 = true;
+	if (flags & KOEI_COMP_FILTER)
+		auto_filter(src, src_size, &rl, &lz77, &huff4, &huff8);
+
+	u32 lz77_bound = src_size + (src_size + 7) / 8 + 8;
+	u32 huff_bound = src_size * 4 + 0x210;
+	trial_t trials[5];
+	auto_t A = {.src = src, .src_size = src_size, .trials = trials};
+	// in order of decoding speed
+	if (rl)
+		trials[A.num++] = (trial_t){trial_rl, 0, src_size + src_size / 128 + 8};
+	if (lz77) {
+		if (flags & KOEI_COMP_OPTIMAL) {
+			trials[A.num++] = (trial_t){trial_lz77_opt, LZ77_EFFORT_DEFAULT, lz77_bound};
+		} else {
+			trials[A.num++] = (trial_t){trial_lz77, false, lz77_bound};
+			trials[A.num++] = (trial_t){trial_lz77, true, lz77_bound};
+		}
+	}
+	if (huff8)
+		trials[A.num++] = (trial_t){trial_huff, true, huff_bound};
+	if (huff4)
+		trials[A.num++] = (trial_t){trial_huff, false, huff_bound};
+
+	if (A.num > 1 && !(flags & KOEI_COMP_INLINE))
+		auto_run(&A);
+	else
+		auto_worker(&A);
+
+	// Bare is the fallback, ties keep the earlier (faster to decode) mode
+	trial_t *best = NULL;
+	u32 size = src_size + 4;
+	for (u32 i = 0; i < A.num; ++i) {
+		if (trials[i].size < size) {
+			best = &trials[i];
+			size = best->size;
+		}
+	}
+	if (best)
+		memcpy(dest, best->buf, size);
+	else
+		size = BareComp(dest, src, src_size);
+	for (u32 i = 0; i < A.num; ++i)
+		free(trials[i].buf);
+	return size;
+}
+
+u32 koei_compress(void *dest, const void *src, u32 src_size, u32 flags)
+{
+	if (flags & KOEI_COMP_AUTO)
+		return auto_compress(dest, src, src_size, flags);
+	bool extra = flags & KOEI_COMP_EXTRA;
 	switch (*(u8*)src >> 4) {
 		case CompressModeBare: return BareComp(dest, src, src_size);
-		case CompressModeLZ77: return LZ77Comp(dest, src, src_size, extra);
+		case CompressModeLZ77:
+			if (flags & KOEI_COMP_OPTIMAL)
+				return LZ77CompOpt(dest, src, src_size, LZ77_EFFORT_DEFAULT);
+			return LZ77Comp(dest, src, src_size, extra);
 		case CompressModeHuff: return HuffComp(dest, src, src_size, extra);
 		case CompressModeRL:   return RLComp(dest, src, src_size);
 		default: return -1;
@@ -19,7 +232,7 @@ void koei_uncompress(void *dest, const void *src, u32 *psize)
 {
 	typedef void (*uncomp_t)(void*, const void*, u32*);
 	static const uncomp_t table[] = {
-		BareUnComp, LZ77UnComp, HuffUnComp, RLUnComp
+		BareUnComp, LZ77UnCompFast, HuffUnComp, RLUnCompFast
 	};
 	if (*(u8*)src >= 0x40) { // invalid type
 		*psize = 0;
@@ -38,114 +251,203 @@ static constexpr u32 BitMaskTable[] = {
 	0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF
 };
 
+/**
+ * bits are read MSB first from 16-bit words, which are interleaved with control bytes and literals.
+ * decoder always looks at the next 16 bits, a word is read as soon as less than 16 bits are left,
+ * so the reservoir never holds more than 31 bits.
+ */
 typedef struct uncompress_t {
 	const u8 *input_ptr;
-	u16 bit_buffer;
-	u16 bit_extension;
-	u8 remain_bits;
-	u8 control_byte;
+	u64 bit_buffer; // MSB first
+	u32 bit_count;
 } uncompress_t;
 
-static void read_bits(uncompress_t *D, u32 num)
+static inline u32 peek_bits(uncompress_t *D)
 {
-	// HI to LO
-	D->bit_buffer <<= num; // throw trash
-	if (D->remain_bits >= num) {
-		D->remain_bits -= num;
-		D->bit_buffer |= (D->bit_extension >> D->remain_bits) & BitMaskTable[num];
-	} else {
-		u32 delta = num - D->remain_bits;
-		D->bit_buffer |= (D->bit_extension & BitMaskTable[D->remain_bits]) << delta;
-		D->bit_extension = *D->input_ptr++;
-		D->bit_extension |= *D->input_ptr++ << 8;
-		D->remain_bits = 16 - delta;
-		D->bit_buffer |= (D->bit_extension >> (16 - delta)) & BitMaskTable[delta];
+	return D->bit_buffer >> 48;
+}
+
+static inline void skip_bits(uncompress_t *D, u32 num)
+{
+	D->bit_buffer <<= num;
+	D->bit_count -= num;
+	if (D->bit_count < 16) {
+		D->bit_buffer |= (u64)(D->input_ptr[0] | D->input_ptr[1] << 8) << (48 - D->bit_count);
+		D->input_ptr += 2;
+		D->bit_count += 16;
 	}
 }
 
+/**
+ * length code: n zeros, 1, n bits (n <= 6), or 7 zeros, 7 bits (+0x80).
+ * the last bit of code is read again as the first bit of distance code.
+ * indexed by the top 7 bits
+ */
+typedef struct length_code_t {
+	u8 shift;
+	u8 add;
+	u8 skip;
+} length_code_t;
+
+static constexpr length_code_t LengthCodeTable[8] = { // by number of leading zeros
+	{15, 0, 0}, {13, 0, 2}, {11, 0, 4}, {9, 0, 6}, {7, 0, 8}, {5, 0, 10}, {3, 0, 12}, {2, 0x80, 13}
+};
+
+/**
+ * distance code, the top bit (shared with length code) is ignored.
+ * indexed by the next 5 bits
+ */
+typedef struct distance_code_t {
+	u16 sub;
+	u16 mask;
+	u16 set;
+	u8 shift;
+	u8 add;
+	u8 skip;
+} distance_code_t;
+
+#define DC(sub,mask,set,shift,add,skip) {sub, mask, set, shift, add, skip}
+static constexpr distance_code_t DistanceCodeTable[32] = {
+	DC(0, 0x600, 0, 9, 0, 7), DC(0, 0x600, 0, 9, 0, 7),
+	DC(0x000, 0x300, 0, 8, 4, 8), // 0x800
+	DC(0xC00, 0xF80, 0, 7, 8, 9), DC(0xC00, 0xF80, 0, 7, 8, 9), DC(0xC00, 0xF80, 0, 7, 8, 9),
+	DC(0x1800, 0x1FC0, 0, 6, 0x20, 10), DC(0x1800, 0x1FC0, 0, 6, 0x20, 10),
+	DC(0x1800, 0x1FC0, 0, 6, 0x20, 10), DC(0x1800, 0x1FC0, 0, 6, 0x20, 10),
+	DC(0x1800, 0x1FC0, 0, 6, 0x20, 10), DC(0x1800, 0x1FC0, 0, 6, 0x20, 10),
+	DC(0, 0xFFF, 0x1000, 5, 0, 11), DC(0, 0xFFF, 0x1000, 5, 0, 11), // 0x3000
+	DC(0, 0xFFF, 0x1000, 5, 0, 11), DC(0, 0xFFF, 0x1000, 5, 0, 11),
+	DC(0, 0xFFF, 0x1000, 4, 0, 12), DC(0, 0xFFF, 0x1000, 4, 0, 12), // 0x4000
+	DC(0, 0xFFF, 0x1000, 4, 0, 12), DC(0, 0xFFF, 0x1000, 4, 0, 12),
+	DC(0, 0xFFF, 0x1000, 3, 0, 13), DC(0, 0xFFF, 0x1000, 3, 0, 13), // 0x5000
+	DC(0, 0xFFF, 0x1000, 3, 0, 13), DC(0, 0xFFF, 0x1000, 3, 0, 13),
+	DC(0, 0xFFF, 0x1000, 2, 0, 14), DC(0, 0xFFF, 0x1000, 2, 0, 14), // 0x6000
+	DC(0, 0xFFF, 0x1000, 2, 0, 14), DC(0, 0xFFF, 0x1000, 2, 0, 14),
+	DC(0, 0xFFF, 0x1000, 1, 0, 15), DC(0, 0xFFF, 0x1000, 1, 0, 15), // 0x7000
+	DC(0, 0xFFF, 0x1000, 1, 0, 15), DC(0, 0xFFF, 0x1000, 1, 0, 15),
+};
+#undef DC
+
+/* number of leading zeros of 7 bits, 7 if all zero */
+static constexpr u8 LeadingZeroTable[128] = {
+	7, 6, 5, 5, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
 void koei_lz77_uncompress(void *dest, const void *src, u32 *psize)
 {
 	u8 *dest_ptr = dest;
-	uncompress_t D = { .input_ptr = src, .remain_bits = 0 };
+	uncompress_t D = { .input_ptr = src, .bit_count = 16 };
+	D.bit_buffer = (u64)(D.input_ptr[0] | D.input_ptr[1] << 8) << 48;
+	D.input_ptr += 2;
 
-	read_bits(&D, 16);
 	while (1) {
-		D.control_byte = *D.input_ptr++;
-		for (u32 i = 0; i < 8; ++i, D.control_byte <<= 1) {
-			if (D.control_byte & 0x80) { // literal
+		u8 control_byte = *D.input_ptr++;
+		for (u32 i = 0; i < 8; ++i, control_byte <<= 1) {
+			if (control_byte & 0x80) { // literal
 				*dest_ptr++ = *D.input_ptr++;
 				continue;
 			}
 			// match length
-			u32 length;
-			if (D.bit_buffer & 0x8000) {
-				length = 1;
-			} else if (D.bit_buffer & 0x4000) {
-				length = (D.bit_buffer & 0x6000) >> 13;
-				read_bits(&D, 2);
-			} else if (D.bit_buffer & 0x2000) {
-				length = (D.bit_buffer & 0x3800) >> 11;
-				read_bits(&D, 4);
-			} else if (D.bit_buffer & 0x1000) {
-				length = (D.bit_buffer & 0x1E00) >> 9;
-				read_bits(&D, 6);
-			} else if (D.bit_buffer & 0x800) {
-				length = (D.bit_buffer & 0xF80) >> 7;
-				read_bits(&D, 8);
-			} else if (D.bit_buffer & 0x400) {
-				length = (D.bit_buffer & 0x7E0) >> 5;
-				read_bits(&D, 10);
-			} else if (D.bit_buffer & 0x200) {
-				length = (D.bit_buffer & 0x3F8) >> 3;
-				read_bits(&D, 12);
-			} else {
-				length = ((D.bit_buffer & 0x1FC) >> 2) + 0x80;
-				if (length != 0xFF) {
-					read_bits(&D, 13);
-				} else {
-					*psize = dest_ptr - (u8*)dest;
-					return;
-				}
+			u32 w = peek_bits(&D);
+			const length_code_t *lc = &LengthCodeTable[LeadingZeroTable[w >> 9]];
+			u32 length = (w >> lc->shift & 0x7F) + lc->add;
+			if (length == 0xFF) { // terminal
+				*psize = dest_ptr - (u8*)dest;
+				return;
 			}
+			skip_bits(&D, lc->skip);
 			// match distance
-			u32 distance;
-			D.bit_buffer &= ~0x8000;
-			if (D.bit_buffer <= 0x7FF) {
-				distance = (D.bit_buffer & 0x600) >> 9;
-				read_bits(&D, 7);
-			} else if (D.bit_buffer <= 0xBFF) {
-				distance = ((D.bit_buffer & 0x300) >> 8) + 4;
-				read_bits(&D, 8);
-			} else if (D.bit_buffer <= 0x17FF) {
-				distance = (((D.bit_buffer - 0xC00) & 0xF80) >> 7) + 8;
-				read_bits(&D, 9);
-			} else if (D.bit_buffer <= 0x2FFF) {
-				distance = (((D.bit_buffer - 0x1800) & 0x1FC0) >> 6) + 0x20;
-				read_bits(&D, 10);
-			} else if (D.bit_buffer <= 0x3FFF) {
-				distance = (D.bit_buffer & 0xFFF | 0x1000) >> 5;
-				read_bits(&D, 11);
-			} else if (D.bit_buffer <= 0x4FFF) {
-				distance = (D.bit_buffer & 0xFFF | 0x1000) >> 4;
-				read_bits(&D, 12);
-			} else if (D.bit_buffer <= 0x5FFF) {
-				distance = (D.bit_buffer & 0xFFF | 0x1000) >> 3;
-				read_bits(&D, 13);
-			} else if (D.bit_buffer <= 0x6FFF) {
-				distance = (D.bit_buffer & 0xFFF | 0x1000) >> 2;
-				read_bits(&D, 14);
-			} else {
-				distance = (D.bit_buffer & 0xFFF | 0x1000) >> 1;
-				read_bits(&D, 15);
-			}
+			w = peek_bits(&D) & 0x7FFF;
+			const distance_code_t *dc = &DistanceCodeTable[w >> 10];
+			u32 distance = ((((w - dc->sub) & dc->mask) | dc->set) >> dc->shift) + dc->add;
+			skip_bits(&D, dc->skip);
 			// copy
 			u8 *window_ptr = dest_ptr - distance - 1;
-			for (u32 i = 0; i <= length; ++i)
-				*dest_ptr++ = *window_ptr++;
+			if (distance >= length) { // not overlapped
+				memcpy(dest_ptr, window_ptr, length + 1);
+				dest_ptr += length + 1;
+			} else if (!distance) { // repeat the last byte
+				memset(dest_ptr, *window_ptr, length + 1);
+				dest_ptr += length + 1;
+			} else {
+				for (u32 i = 0; i <= length; ++i)
+					*dest_ptr++ = *window_ptr++;
+			}
 		}
 	}
 }
 
+static void stream_next_koei(uncomp_stream_t *S)
+{
+	if (!S->lz.nflags) {
+		if (!uncomp_stream_need(S, 1))
+			return;
+		S->lz.flags = *S->src++;
+		S->lz.nflags = 8;
+	}
+	bool literal = S->lz.flags & 0x80;
+	S->lz.flags <<= 1;
+	--S->lz.nflags;
+	if (literal) {
+		S->op = STREAM_OP_RAW;
+		S->len = 1;
+		return;
+	}
+	uncompress_t D = { .input_ptr = S->src, .bit_buffer = S->lz.bb, .bit_count = S->lz.nb };
+	// match length
+	u32 w = peek_bits(&D);
+	const length_code_t *lc = &LengthCodeTable[LeadingZeroTable[w >> 9]];
+	u32 length = (w >> lc->shift & 0x7F) + lc->add;
+	if (length == 0xFF) { // terminal, the size is known now
+		S->size = S->done;
+		S->end = true;
+		return;
+	}
+	// a word is read whenever less than 16 bits are left
+	if (D.bit_count - lc->skip < 16 && !uncomp_stream_need(S, 2))
+		return;
+	skip_bits(&D, lc->skip);
+	// match distance
+	w = peek_bits(&D) & 0x7FFF;
+	const distance_code_t *dc = &DistanceCodeTable[w >> 10];
+	u32 distance = ((((w - dc->sub) & dc->mask) | dc->set) >> dc->shift) + dc->add;
+	if (D.bit_count - dc->skip < 16 && !uncomp_stream_need(S, D.input_ptr - S->src + 2))
+		return;
+	skip_bits(&D, dc->skip);
+	S->src = D.input_ptr;
+	S->lz.bb = D.bit_buffer;
+	S->lz.nb = D.bit_count;
+	S->op = STREAM_OP_COPY;
+	S->len = length + 1;
+	S->of = distance + 1;
+}
+
+void koei_lz77_stream_init(uncomp_stream_t *S, const void *src, u32 src_size)
+{
+	const u8 *p = src;
+	*S = (uncomp_stream_t){
+		.kind = STREAM_KIND_WINDOW,
+		.next = stream_next_koei,
+		.src = p,
+		.src_end = src_size == (u32)-1 ? NULL : p + src_size,
+		.size = -1
+	};
+	if (!uncomp_stream_need(S, 2)) {
+		S->size = 0;
+		return;
+	}
+	S->src += 2;
+	S->lz.bb = (u64)(p[0] | p[1] << 8) << 48;
+	S->lz.nb = 16;
+	memset(S->lz.window, 0, sizeof(S->lz.window));
+}
+
 typedef struct compress_t {
     u8 *output_ptr;
 	u8 *curr_ptr;
@@ -173,52 +475,144 @@ static void write_bits(compress_t *C, u32 bits, u32 num_bits)
 	C->remain_bits = (C->remain_bits - num_bits + 16) & 0xF;
 }
 
-static void flush_bits(compress_t *C)
+/**
+ * decoder reads the next word once it starts reading the current one,
+ * so `next_ptr` is only dropped if it was reserved by the terminal, which is never read
+ */
+static void flush_bits(compress_t *C, bool drop_next)
 {
     if (C->bit_count > 0) {
         C->curr_ptr[0] = C->bit_buffer >> 16 & 0xFF;
 		C->curr_ptr[1] = C->bit_buffer >> 24;
     }
-	C->output_ptr -= 2; // `next_ptr` read 2 bytes
+	if (drop_next)
+		C->output_ptr -= 2; // `next_ptr` read 2 bytes
 }
 
-static int find_match(const u8 *src, u32 src_pos, u32 max_len, u32 window_size, u32 *length, u32 *distance)
+/**
+ * binary tree match finder
+ * positions with the same first 2 bytes form a binary search tree ordered by their strings,
+ * newer positions are nearer the root, so walking down from the root meets the nearest
+ * position for each match length. positions out of window are cut off as null.
+ */
+
+#define KOEI_WINDOW 0xFFF
+#define KOEI_MIN_LEN 2
+#define KOEI_MAX_LEN 0xFF
+#define KOEI_CYCLIC (KOEI_WINDOW + 1)
+
+typedef struct finder_t {
+	const u8 *src;
+	u32 src_size;
+	s32 head[0x10000];
+	s32 son[KOEI_CYCLIC * 2]; // left and right child
+} finder_t;
+
+static void finder_init(finder_t *F, const void *src, u32 src_size)
 {
-    u32 max_match = 0;
-    u32 best_dist = 0;
-    u32 start = (src_pos > window_size) ? src_pos - window_size : 0;
-    for (u32 i = start; i < src_pos; ++i) { // not lazy
-        u32 j = 0;
-        while (j < max_len && src[i + j] == src[src_pos + j]) ++j;
-        if (j >= max_match) {
-            max_match = j;
-            best_dist = src_pos - i;
-        }
-    }
-	u32 num_bits;
-	switch (max_match - 1) {
-		case 1: num_bits = 1; break;
-		case 2 ... 3: num_bits = 3; break;
-		case 4 ... 7: num_bits = 5; break;
-		case 8 ... 0xF: num_bits = 7; break;
-		case 0x10 ... 0x1F: num_bits = 9; break;
-		case 0x20 ... 0x3F: num_bits = 11; break;
-		case 0x40 ... 0x7F: num_bits = 13; break;
-		case 0x80 ... 0xFE: num_bits = 14; break;
+	F->src = src;
+	F->src_size = src_size;
+	memset(F->head, -1, sizeof(F->head));
+}
+
+/**
+ * insert `src_pos` into tree and collect matches
+ * @param matches pairs of (length, distance), length is increasing, distance is nearest for the length.
+ *                NULL if we only insert
+ * @return        number of pairs
+ */
+static u32 finder_find(finder_t *F, u32 src_pos, u32 max_len, u32 *matches)
+{
+	if (max_len < KOEI_MIN_LEN)
+		return 0;
+	const u8 *cur = F->src + src_pos;
+	u32 h = cur[0] | cur[1] << 8;
+	s32 cm = F->head[h];
+	F->head[h] = src_pos;
+	s32 *ptr0 = F->son + (src_pos % KOEI_CYCLIC) * 2 + 1;
+	s32 *ptr1 = F->son + (src_pos % KOEI_CYCLIC) * 2;
+	u32 len0 = 0, len1 = 0, best = KOEI_MIN_LEN - 1, n = 0;
+	while (1) {
+		if (cm < 0 || src_pos - cm > KOEI_WINDOW) {
+			*ptr0 = *ptr1 = -1;
+			break;
+		}
+		const u8 *pb = F->src + cm;
+		s32 *pair = F->son + (cm % KOEI_CYCLIC) * 2;
+		u32 len = len0 < len1 ? len0 : len1;
+		if (pb[len] == cur[len]) {
+			while (++len < max_len && pb[len] == cur[len]);
+			if (len > best && matches) {
+				best = len;
+				matches[n++] = len;
+				matches[n++] = src_pos - cm;
+			}
+			if (len == max_len) { // take place of the old one
+				*ptr1 = pair[0];
+				*ptr0 = pair[1];
+				break;
+			}
+		}
+		if (pb[len] < cur[len]) {
+			*ptr1 = cm;
+			ptr1 = pair + 1;
+			cm = *ptr1;
+			len1 = len;
+		} else {
+			*ptr0 = cm;
+			ptr0 = pair;
+			cm = *ptr0;
+			len0 = len;
+		}
+	}
+	return n >> 1;
+}
+
+/* number of bits written by `write_length`, 0 if not encodable */
+static u32 length_bits(u32 length)
+{
+	switch (length) {
+		case 1: return 1;
+		case 2 ... 3: return 3;
+		case 4 ... 7: return 5;
+		case 8 ... 0xF: return 7;
+		case 0x10 ... 0x1F: return 9;
+		case 0x20 ... 0x3F: return 11;
+		case 0x40 ... 0x7F: return 13;
+		case 0x80 ... 0xFE: return 14;
 		default: return 0;
 	}
-	switch (best_dist - 1) {
-		case 0 ... 3: num_bits += 6; break;
-		case 4 ... 7: num_bits += 7; break;
-		case 8 ... 0x1F: num_bits += 8; break;
-		case 0x20 ... 0x7F: num_bits += 9; break;
-		case 0x80 ... 0xFF: num_bits += 10; break;
-		case 0x100 ... 0x1FF: num_bits += 11; break;
-		case 0x200 ... 0x3FF: num_bits += 12; break;
-		case 0x400 ... 0x7FF: num_bits += 13; break;
-		case 0x800 ... 0xFFF: num_bits += 14; break;
+}
+
+/* number of bits written by `write_distance`, 0 if not encodable */
+static u32 distance_bits(u32 distance)
+{
+	switch (distance) {
+		case 0 ... 3: return 6;
+		case 4 ... 7: return 7;
+		case 8 ... 0x1F: return 8;
+		case 0x20 ... 0x7F: return 9;
+		case 0x80 ... 0xFF: return 10;
+		case 0x100 ... 0x1FF: return 11;
+		case 0x200 ... 0x3FF: return 12;
+		case 0x400 ... 0x7FF: return 13;
+		case 0x800 ... 0xFFF: return 14;
 		default: return 0;
 	}
+}
+
+static int find_match(finder_t *F, u32 src_pos, u32 max_len, u32 *length, u32 *distance)
+{
+	u32 matches[KOEI_MAX_LEN * 2];
+	u32 n = finder_find(F, src_pos, max_len, matches);
+	if (!n)
+		return 0;
+	u32 max_match = matches[n * 2 - 2]; // longest and nearest
+	u32 best_dist = matches[n * 2 - 1];
+	u32 num_bits = length_bits(max_match - 1), dist_bits = distance_bits(best_dist - 1);
+	if (!num_bits || !dist_bits)
+		return 0;
+	num_bits += dist_bits;
     if (num_bits < max_match << 3) {
         *length = max_match;
         *distance = best_dist;
@@ -271,10 +665,80 @@ static void write_distance(compress_t *C, u32 distance)
     }
 }
 
+/**
+ * optimal parse
+ * shortest path in bits over positions, a literal costs 1 + 8 bits,
+ * a match costs 1 + `length_bits` + `distance_bits`.
+ * every length up to a match found by the tree is tried at its nearest distance.
+ * on return, `len[pos]`/`dist[pos]` is the token starting at `pos` (length 1 for literal)
+ */
+static bool optimal_parse(finder_t *F, u32 src_size, u8 *len, u16 *dist)
+{
+	u32 *price = alloc(src_size + 1, price);
+	if (!price)
+		return false;
+	memset(price, 0xFF, (src_size + 1) * sizeof(*price));
+	price[0] = 0;
+	u32 matches[KOEI_MAX_LEN * 2];
+	for (u32 pos = 0; pos < src_size; ++pos) {
+		u32 max_len = src_size - pos > KOEI_MAX_LEN ? KOEI_MAX_LEN : src_size - pos;
+		u32 n = finder_find(F, pos, max_len, matches);
+		u32 c = price[pos] + 1 + 8;
+		if (c < price[pos + 1]) {
+			price[pos + 1] = c;
+			len[pos + 1] = 1;
+		}
+		for (u32 i = 0, l = KOEI_MIN_LEN; i < n; ++i) {
+			u32 d = matches[i * 2 + 1];
+			u32 base = price[pos] + 1 + distance_bits(d - 1);
+			for (; l <= matches[i * 2]; ++l) {
+				c = base + length_bits(l - 1);
+				if (c < price[pos + l]) {
+					price[pos + l] = c;
+					len[pos + l] = l;
+					dist[pos + l] = d;
+				}
+			}
+		}
+	}
+	free(price);
+	// trace back, move each token from its end to its start
+	u32 l = len[src_size], d = dist[src_size];
+	for (u32 pos = src_size; pos; ) {
+		pos -= l;
+		u32 pl = len[pos], pd = dist[pos];
+		len[pos] = l;
+		dist[pos] = d;
+		l = pl, d = pd;
+	}
+	return true;
+}
+
 u32 koei_lz77_compress(void *dest, const void *src, u32 src_size)
+{
+	return koei_lz77_compress_ex(dest, src, src_size, KOEI_LZ77_GREEDY);
+}
+
+u32 koei_lz77_compress_ex(void *dest, const void *src, u32 src_size, int effort)
 {
     compress_t C = { .output_ptr = dest + 2, .next_ptr = dest, .bit_buffer = 0, .bit_count = 0 };
     const u8 *src_ptr = src;
+	u8 *opt_len = NULL;
+	u16 *opt_dist = NULL;
+	finder_t *F = alloc(1, F);
+	if (!F)
+		return -1;
+	finder_init(F, src, src_size);
+	if (effort >= KOEI_LZ77_OPTIMAL) {
+		opt_len = alloc(src_size + 1, opt_len);
+		opt_dist = alloc(src_size + 1, opt_dist);
+		if (!opt_len || !opt_dist || !optimal_parse(F, src_size, opt_len, opt_dist)) {
+			free(F);
+			free(opt_len);
+			free(opt_dist);
+			return -1;
+		}
+	}
 
     u32 control_byte = 0;
     u32 control_bit = 0;
@@ -284,12 +748,22 @@ u32 koei_lz77_compress(void *dest, const void *src, u32 src_size)
         u32 length, distance;
 		u32 src_pos = (void*)src_ptr - src;
 		u32 max_len = src_size - src_pos > 0xFF ? 0xFF : src_size - src_pos;
-        if (find_match(src, src_pos, max_len, 0xFFF, &length, &distance)) {
+		bool match;
+		if (opt_len) {
+			length = opt_len[src_pos];
+			distance = opt_dist[src_pos];
+			match = length > 1;
+		} else {
+			match = find_match(F, src_pos, max_len, &length, &distance);
+		}
+        if (match) {
             // control bit 0
             control_byte <<= 1;
             write_length(&C, length - 1);
             write_distance(&C, distance - 1);
             src_ptr += length;
+			for (u32 i = src_pos + 1; !opt_len && i < src_pos + length; ++i) // keep tree up to date
+				finder_find(F, i, src_size - i > 0xFF ? 0xFF : src_size - i, NULL);
         } else { // literal
             // control bit 1
             control_byte = (control_byte << 1) | 1;
@@ -303,6 +777,7 @@ u32 koei_lz77_compress(void *dest, const void *src, u32 src_size)
         }
     }
     // terminal
+	u8 *next_ptr = C.next_ptr;
     write_bits(&C, 0x7F, 14);
     // remain control bits
 	control_byte <<= 1;
@@ -310,7 +785,10 @@ u32 koei_lz77_compress(void *dest, const void *src, u32 src_size)
 	control_byte <<= (8 - control_bit);
 	*control_addr = control_byte;
 
-    flush_bits(&C);
+    flush_bits(&C, C.next_ptr != next_ptr);
+	free(F);
+	free(opt_len);
+	free(opt_dist);
 
     return C.output_ptr - (u8*)dest;
 }
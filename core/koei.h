@@ -5,11 +5,24 @@
 #include "gba.h"
 
 /* Compress */
-u32 koei_compress(void *dest, const void *src, u32 src_size, bool extra);
+#define KOEI_COMP_EXTRA 0x1 /* LZ77: lazy, Huff: 8-bit */
+#define KOEI_COMP_OPTIMAL 0x2 /* LZ77: optimal parse, smallest but slower */
+#define KOEI_COMP_AUTO 0x4 /* try all modes in parallel, keep the smallest, dest needs src_size + 4 */
+#define KOEI_COMP_FILTER 0x8 /* auto: skip modes which cannot beat Bare */
+#define KOEI_COMP_INLINE 0x10 /* auto: run all modes on the calling thread, for callers already in parallel */
+
+u32 koei_compress(void *dest, const void *src, u32 src_size, u32 flags);
 void koei_uncompress(void *dest, const void *src, u32 *psize);
 int koei_get_compress_type(const void *src);
+
+/* effort of koei_lz77_compress_ex */
+#define KOEI_LZ77_GREEDY 0 /* longest match, fast */
+#define KOEI_LZ77_OPTIMAL 1 /* fewest bits */
+
 u32 koei_lz77_compress(void *dest, const void *src, u32 src_size);
+u32 koei_lz77_compress_ex(void *dest, const void *src, u32 src_size, int effort);
 void koei_lz77_uncompress(void *dest, const void *src, u32 *psize);
+void koei_lz77_stream_init(uncomp_stream_t *S, const void *src, u32 src_size); /* read by uncomp_stream_read */
 
 
 /* Indexed Character */
@@ -0,0 +1,263 @@
+#include "scan.h"
+#include "batch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * headers are word aligned: type byte 0x10 (LZ77), 0x24/0x28 (Huffman) or 0x30 (RL),
+ * followed by 24-bit uncompressed size.
+ * candidates are validated by decoding without output, every read is checked against the end of ROM.
+ */
+
+static inline bool is_header(u32 w, u32 min_size, u32 max_size)
+{
+	u8 type = w & 0xFF;
+	u32 size = w >> 8;
+	return (type == 0x10 || type == 0x24 || type == 0x28 || type == 0x30)
+		&& size >= min_size && size <= max_size;
+}
+
+/* word offsets of candidates in [begin, end), return the number */
+static u32 filter_headers(const u8 *rom, u32 begin, u32 end, u32 min_size, u32 max_size, u32 *out)
+{
+	u32 n = 0, i = begin;
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	const __m128i lz77 = _mm_set1_epi32(0x10), huff4 = _mm_set1_epi32(0x24);
+	const __m128i huff8 = _mm_set1_epi32(0x28), rl = _mm_set1_epi32(0x30);
+	// size is 24-bit, signed compare is fine
+	const __m128i lo = _mm_set1_epi32(min_size - 1), hi = _mm_set1_epi32(max_size + 1);
+	for (; i + 16 <= end; i += 16) {
+		__m128i w = _mm_loadu_si128((const __m128i*)(rom + i));
+		__m128i t = _mm_and_si128(w, mask);
+		__m128i ok = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi32(t, lz77), _mm_cmpeq_epi32(t, huff4)),
+			_mm_or_si128(_mm_cmpeq_epi32(t, huff8), _mm_cmpeq_epi32(t, rl)));
+		__m128i size = _mm_srli_epi32(w, 8);
+		ok = _mm_and_si128(ok, _mm_and_si128(_mm_cmpgt_epi32(size, lo), _mm_cmplt_epi32(size, hi)));
+		u32 bits = _mm_movemask_ps(_mm_castsi128_ps(ok));
+		while (bits) {
+			u32 k = __builtin_ctz(bits);
+			out[n++] = i + k * 4;
+			bits &= bits - 1;
+		}
+	}
+#endif
+	for (; i + 4 <= end; i += 4) {
+		u32 w;
+		memcpy(&w, rom + i, 4);
+		if (is_header(w, min_size, max_size))
+			out[n++] = i;
+	}
+	return n;
+}
+
+/////////////
+// dry run //
+/////////////
+
+/* return input used, or 0 if broken */
+static u32 check_rl(const u8 *src, const u8 *end, u32 size)
+{
+	const u8 *p = src + 4;
+	while (size) {
+		if (p >= end)
+			return 0;
+		u8 b = *p++;
+		u32 len = (b & 0x7F) + (b & 0x80 ? 3 : 1);
+		u32 in = b & 0x80 ? 1 : len;
+		if (in > (u32)(end - p))
+			return 0;
+		p += in;
+		size -= len < size ? len : size;
+	}
+	return p - src;
+}
+
+static u32 check_lz77(const u8 *src, const u8 *end, u32 size)
+{
+	const u8 *p = src + 4;
+	u32 pos = 0;
+	while (pos < size) {
+		if (p >= end)
+			return 0;
+		u8 f = *p++;
+		for (u32 i = 0; i < 8 && pos < size; ++i, f <<= 1) {
+			if (f & 0x80) { // offset + length
+				if (end - p < 2)
+					return 0;
+				u32 of = (p[1] | (p[0] & 0xF) << 8) + 1;
+				if (of > pos) // before the beginning
+					return 0;
+				pos += (p[0] >> 4) + 3;
+				p += 2;
+			} else { // raw
+				if (p >= end)
+					return 0;
+				++p;
+				++pos;
+			}
+		}
+	}
+	return p - src;
+}
+
+static u32 check_huff(const u8 *src, const u8 *end, u32 size, u32 bits)
+{
+	const u8 *tree = src + 4;
+	if (tree >= end)
+		return 0;
+	const u8 *tree_end = tree + ((*tree + 1) << 1);
+	if (tree_end > end)
+		return 0;
+	const u8 *p = tree_end; // data
+	u32 word = 0, nb = 0;
+	for (u64 rem = (u64)size * (8 / bits); rem; --rem) {
+		const u8 *q = tree + 1;
+		bool leaf = false;
+		while (!leaf) {
+			if (!nb) {
+				if (end - p < 4)
+					return 0;
+				memcpy(&word, p, 4);
+				p += 4;
+				nb = 32;
+			}
+			u32 f = word >> 31;
+			word <<= 1;
+			--nb;
+			leaf = *q << f & 0x80;
+			q = (const u8*)((uintptr_t)q & ~1) + (((*q & 0x3F) + 1) << 1) + f;
+			if (q >= tree_end)
+				return 0;
+		}
+		if (*q >> bits) // symbol too large
+			return 0;
+	}
+	return p - src;
+}
+
+static void validate(const u8 *rom, u32 rom_size, scan_entry_t *E)
+{
+	const u8 *src = rom + E->offset, *end = rom + rom_size;
+	u32 used = 0;
+	switch (E->type) {
+		case 0x10: used = check_lz77(src, end, E->size); break;
+		case 0x24: used = check_huff(src, end, E->size, 4); break;
+		case 0x28: used = check_huff(src, end, E->size, 8); break;
+		case 0x30: used = check_rl(src, end, E->size); break;
+	}
+	E->valid = used != 0;
+	E->packed_size = used;
+}
+
+/////////////
+// threads //
+/////////////
+
+typedef struct scan_task_t {
+	const u8 *rom;
+	u32 rom_size, min_size, max_size;
+	u32 begin, end; // range of ROM to filter
+	u32 *offsets;
+	u32 num;
+	scan_entry_t *entries;
+	atomic_uint *next; // next entry to validate
+} scan_task_t;
+
+#define SCAN_BLOCK 64 /* entries taken at once by validation */
+
+static void *filter_main(void *arg)
+{
+	scan_task_t *T = arg;
+	T->num = filter_headers(T->rom, T->begin, T->end, T->min_size, T->max_size, T->offsets);
+	return NULL;
+}
+
+static void *validate_main(void *arg)
+{
+	scan_task_t *T = arg;
+	for (u32 i; (i = atomic_fetch_add(T->next, SCAN_BLOCK)) < T->num; )
+		for (u32 j = i; j < i + SCAN_BLOCK && j < T->num; ++j)
+			validate(T->rom, T->rom_size, &T->entries[j]);
+	return NULL;
+}
+
+static void run_tasks(void *(*fn)(void*), scan_task_t *tasks, u32 num)
+{
+	pthread_t threads[num];
+	bool started[num];
+	for (u32 i = 1; i < num; ++i)
+		started[i] = !pthread_create(&threads[i], NULL, fn, &tasks[i]);
+	fn(&tasks[0]);
+	for (u32 i = 1; i < num; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			fn(&tasks[i]);
+	}
+}
+
+/**
+ * return the number of candidates, `*entries` is malloc'd and ordered by offset.
+ * size range is [min_size, max_size], num_threads is 0 for all cores
+ */
+u32 scan_ROM(const u8 *rom, u32 rom_size, u32 min_size, u32 max_size, u32 num_threads, scan_entry_t **entries)
+{
+	*entries = NULL;
+	if (!num_threads)
+		num_threads = batch_num_cpus();
+	if (max_size > 0xFFFFFF)
+		max_size = 0xFFFFFF;
+	if (!min_size)
+		min_size = 1;
+	rom_size &= ~3;
+	// split ROM into word aligned chunks
+	scan_task_t tasks[num_threads];
+	u32 chunk = (rom_size / num_threads + 3) & ~3;
+	for (u32 i = 0; i < num_threads; ++i) {
+		u32 begin = i * chunk < rom_size ? i * chunk : rom_size;
+		u32 end = begin + chunk < rom_size && i + 1 < num_threads ? begin + chunk : rom_size;
+		tasks[i] = (scan_task_t){rom, rom_size, min_size, max_size, begin, end};
+		tasks[i].offsets = malloc(((end - begin) / 4 + 1) * sizeof(u32));
+	}
+	u32 n = 0;
+	for (u32 i = 0; i < num_threads; ++i) {
+		if (!tasks[i].offsets)
+			goto clean;
+	}
+	run_tasks(filter_main, tasks, num_threads);
+	for (u32 i = 0; i < num_threads; ++i)
+		n += tasks[i].num;
+	scan_entry_t *E = malloc((n + 1) * sizeof(*E));
+	if (!E) {
+		n = 0;
+		goto clean;
+	}
+	n = 0;
+	for (u32 i = 0; i < num_threads; ++i) {
+		for (u32 j = 0; j < tasks[i].num; ++j) {
+			u32 w, of = tasks[i].offsets[j];
+			memcpy(&w, rom + of, 4);
+			E[n++] = (scan_entry_t){.offset = of, .type = w & 0xFF, .size = w >> 8};
+		}
+	}
+	// validate in small blocks, as valid streams (slow to check) are dense in some areas
+	atomic_uint next = 0;
+	for (u32 i = 0; i < num_threads; ++i) {
+		tasks[i].entries = E;
+		tasks[i].num = n;
+		tasks[i].next = &next;
+	}
+	run_tasks(validate_main, tasks, num_threads);
+	*entries = E;
+clean:
+	for (u32 i = 0; i < num_threads; ++i)
+		free(tasks[i].offsets);
+	return n;
+}
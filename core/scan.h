@@ -0,0 +1,22 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include "core.h"
+#include "gba.h"
+
+/* find BIOS compressed streams */
+
+#define SCAN_MIN_SIZE 0x20 /* default range of uncompressed size */
+#define SCAN_MAX_SIZE 0x80000
+
+typedef struct scan_entry_t {
+	u32 offset; // in ROM
+	u8 type; // type byte of header
+	bool valid; // decoded without error
+	u32 packed_size; // input used by decoding, including header
+	u32 size; // uncompressed size
+} scan_entry_t;
+
+u32 scan_ROM(const u8 *rom, u32 rom_size, u32 min_size, u32 max_size, u32 num_threads, scan_entry_t **entries);
+
+#endif // _SCAN_H
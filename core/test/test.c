@@ -0,0 +1,281 @@
+/**
+ * codec tests
+ * usage: test
+ *
+ * LZ77 (greedy, lazy, optimal) and RL output of the corpus is uncompressed by the fast decoders
+ * and by the reference ones, which must give the input back.
+ * crafted LZ77 streams cover offsets 1-7 (replicated by the fast decoder) and matches
+ * within the last 24 bytes (where it falls back to byte copies), crafted RL streams end with
+ * a run longer than the rest of output.
+ * output of the fast decoders is followed by guard bytes, which must never be written.
+ *
+ * failures are printed, exit code is 1 if any.
+ */
+
+#include "core/gba.h"
+#include "core/bench/corpus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GUARD 0x100 /* bytes after *psize, more than the longest run of RL or LZ77 */
+#define GUARD_BYTE 0xA5
+#define SLACK 0x100 /* reference decoders may write whole runs beyond *psize */
+
+static u32 Tests, Failures;
+
+static void fail(const char *what, const char *name, u32 size)
+{
+	++Failures;
+	if (Failures <= 20)
+		printf("FAIL %s: %s, %u bytes\n", what, name, size);
+}
+
+/* output buffer of `size` bytes and guard */
+static u8 *guarded(u32 size)
+{
+	u8 *p = malloc(size + GUARD);
+	memset(p, GUARD_BYTE, size + GUARD);
+	return p;
+}
+
+static bool guard_ok(const u8 *p, u32 size)
+{
+	for (u32 i = 0; i < GUARD; ++i)
+		if (p[size + i] != GUARD_BYTE)
+			return false;
+	return true;
+}
+
+/**
+ * uncompress `packed` of `size` bytes by the fast and the reference decoder, compare with `expect`.
+ * `packed` is followed by enough zero bytes for the reference decoder.
+ */
+static void check_stream(const char *name, const u8 *packed, u32 packed_size, const u8 *expect, u32 size,
+	void (*fast)(void*, const void*, u32*), void (*ref)(void*, const void*, u32*))
+{
+	++Tests;
+	u8 *out = guarded(size);
+	u32 n = size;
+	fast(out, packed, &n);
+	if (n != size || memcmp(out, expect, size))
+		fail("fast decoder", name, size);
+	if (!guard_ok(out, size))
+		fail("fast decoder wrote beyond *psize", name, size);
+
+	// too small: nothing is written, the size is returned
+	if (size) {
+		memset(out, GUARD_BYTE, size + GUARD);
+		n = size - 1;
+		fast(out, packed, &n);
+		if (n != size || !guard_ok(out, 0))
+			fail("fast decoder with small buffer", name, size);
+	}
+	free(out);
+
+	u8 *ref_out = malloc(size + SLACK);
+	n = size + SLACK;
+	ref(ref_out, packed, &n);
+	if (n != size || memcmp(ref_out, expect, size))
+		fail("reference decoder", name, size);
+	free(ref_out);
+
+	if (fast == LZ77UnCompFast) {
+		u8 *safe_out = guarded(size);
+		n = size;
+		if (!LZ77UnCompSafe(safe_out, packed, packed_size, &n) || n != size || memcmp(safe_out, expect, size))
+			fail("safe decoder", name, size);
+		if (!guard_ok(safe_out, size))
+			fail("safe decoder wrote beyond *psize", name, size);
+		free(safe_out);
+	}
+}
+
+////////////
+// corpus //
+////////////
+
+static u32 lz77_greedy(void *dest, const void *src, u32 src_size) { return LZ77Comp(dest, src, src_size, false); }
+static u32 lz77_lazy(void *dest, const void *src, u32 src_size) { return LZ77Comp(dest, src, src_size, true); }
+static u32 lz77_optimal(void *dest, const void *src, u32 src_size) { return LZ77CompOpt(dest, src, src_size, LZ77_EFFORT_DEFAULT); }
+
+static const struct {
+	const char *name;
+	u32 (*comp)(void *dest, const void *src, u32 src_size);
+	void (*fast)(void*, const void*, u32*);
+	void (*ref)(void*, const void*, u32*);
+} Codecs[] = {
+	{"LZ77", lz77_greedy, LZ77UnCompFast, LZ77UnComp},
+	{"LZ77Lazy", lz77_lazy, LZ77UnCompFast, LZ77UnComp},
+	{"LZ77Opt", lz77_optimal, LZ77UnCompFast, LZ77UnComp},
+	{"RL", RLComp, RLUnCompFast, RLUnComp},
+};
+
+static void test_corpus(void)
+{
+	static const u32 sizes[] = {1, 2, 3, 7, 8, 9, 23, 24, 25, 31, 100, 1000, 4097, 0x10000};
+	for (u32 g = 0; g < lenof(Generators); ++g) {
+		for (u32 s = 0; s < lenof(sizes); ++s) {
+			u32 size = sizes[s];
+			corpus_seed(g * 1000 + s + 1);
+			u8 *src = malloc(size);
+			Generators[g].gen(src, size);
+			u8 *packed = calloc(size * 2 + 0x100, 1);
+			for (u32 c = 0; c < lenof(Codecs); ++c) {
+				char name[64];
+				snprintf(name, sizeof(name), "%s %s", Generators[g].name, Codecs[c].name);
+				memset(packed, 0, size * 2 + 0x100);
+				u32 packed_size = Codecs[c].comp(packed, src, size);
+				if (packed_size == (u32)-1) {
+					fail("compress", name, size);
+					continue;
+				}
+				check_stream(name, packed, packed_size, src, size, Codecs[c].fast, Codecs[c].ref);
+			}
+			free(src);
+			free(packed);
+		}
+	}
+}
+
+/////////////
+// crafted //
+/////////////
+
+/* LZ77 stream written token by token, and its expected output */
+typedef struct craft_t {
+	u8 *p; // next byte of stream
+	u8 *flag; // flag byte of the current group
+	u32 bit; // next flag bit, 0 if a new group starts
+	u8 *out;
+	u32 size;
+} craft_t;
+
+static void craft_token(craft_t *C, bool match)
+{
+	if (!C->bit) {
+		C->flag = C->p++;
+		*C->flag = 0;
+		C->bit = 8;
+	}
+	if (match)
+		*C->flag |= 1 << (C->bit - 1);
+	--C->bit;
+}
+
+static void craft_raw(craft_t *C, u8 b)
+{
+	craft_token(C, false);
+	*C->p++ = b;
+	C->out[C->size++] = b;
+}
+
+static void craft_match(craft_t *C, u32 of, u32 len)
+{
+	craft_token(C, true);
+	*C->p++ = (len - 3) << 4 | (of - 1) >> 8;
+	*C->p++ = of - 1;
+	for (u32 i = 0; i < len; ++i, ++C->size)
+		C->out[C->size] = C->out[C->size - of];
+}
+
+static void craft_begin(craft_t *C, u8 *stream, u8 *out)
+{
+	*C = (craft_t){.p = stream + 4, .out = out};
+}
+
+static u32 craft_end(craft_t *C, u8 *stream)
+{
+	*(u32*)stream = C->size << 8 | CompressModeLZ77 << 4;
+	return C->p - stream;
+}
+
+static void test_crafted(void)
+{
+	static const u32 offsets[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 0x1000};
+	u8 *stream = calloc(0x4000, 1), *out = malloc(0x4000);
+	craft_t C;
+	char name[64];
+	corpus_seed(7);
+	// one match at a short offset, followed by 0-30 literals, so it lands in or before the last 24 bytes
+	for (u32 o = 0; o < lenof(offsets); ++o) {
+		for (u32 len = 3; len <= 18; ++len) {
+			for (u32 tail = 0; tail <= 30; ++tail) {
+				u32 of = offsets[o];
+				memset(stream, 0, 0x4000);
+				craft_begin(&C, stream, out);
+				for (u32 i = 0; i < of + len % 5; ++i)
+					craft_raw(&C, rand32());
+				craft_match(&C, of, len);
+				for (u32 i = 0; i < tail; ++i)
+					craft_raw(&C, rand32());
+				u32 packed_size = craft_end(&C, stream);
+				snprintf(name, sizeof(name), "crafted of %u len %u tail %u", of, len, tail);
+				check_stream(name, stream, packed_size, out, C.size, LZ77UnCompFast, LZ77UnComp);
+			}
+		}
+	}
+	// runs of short matches up to the very end
+	for (u32 it = 0; it < 2000; ++it) {
+		memset(stream, 0, 0x4000);
+		craft_begin(&C, stream, out);
+		u32 lits = 1 + rand32() % 8;
+		for (u32 i = 0; i < lits; ++i)
+			craft_raw(&C, rand32());
+		u32 tokens = 1 + rand32() % 40;
+		for (u32 i = 0; i < tokens; ++i) {
+			if (rand32() % 4 == 0) {
+				craft_raw(&C, rand32());
+				continue;
+			}
+			u32 of = 1 + rand32() % (C.size < 7 ? C.size : 7);
+			craft_match(&C, of, 3 + rand32() % 16);
+		}
+		u32 packed_size = craft_end(&C, stream);
+		snprintf(name, sizeof(name), "crafted run %u", it);
+		check_stream(name, stream, packed_size, out, C.size, LZ77UnCompFast, LZ77UnComp);
+	}
+	free(stream);
+	free(out);
+}
+
+/* RL streams whose last run is cut by the size in header */
+static void test_crafted_rl(void)
+{
+	u8 *stream = calloc(0x1000, 1), *out = malloc(0x1000);
+	char name[64];
+	corpus_seed(11);
+	for (u32 it = 0; it < 2000; ++it) {
+		memset(stream, 0, 0x1000);
+		u8 *p = stream + 4;
+		u32 size = 0, len = 0;
+		for (u32 runs = 1 + rand32() % 8; runs--; size += len) {
+			if (rand32() % 2) { // duplicate bytes
+				len = 3 + rand32() % 128;
+				*p++ = 0x80 | (len - 3);
+				*p++ = rand32();
+				memset(out + size, p[-1], len);
+			} else {
+				len = 1 + rand32() % 128;
+				*p++ = len - 1;
+				for (u32 i = 0; i < len; ++i)
+					*p++ = out[size + i] = rand32();
+			}
+		}
+		size -= rand32() % len; // within the last run
+		*(u32*)stream = size << 8 | CompressModeRL << 4;
+		snprintf(name, sizeof(name), "crafted RL %u", it);
+		check_stream(name, stream, p - stream, out, size, RLUnCompFast, RLUnComp);
+	}
+	free(stream);
+	free(out);
+}
+
+int main(void)
+{
+	test_corpus();
+	test_crafted();
+	test_crafted_rl();
+	printf("%u tests, %u failures\n", Tests, Failures);
+	return Failures != 0;
+}
@@ -1,6 +1,6 @@
 /**
  * eps - UPS-like patch
- * format:
+ * format v1:
  * Magic: 'EPS\1' (4 bytes)
  * Description: string (variable length)
  * Original file size: vint
@@ -11,15 +11,57 @@
  *
  * note:
  * we always assume that the size of the original file is equal to the modified file.
+ * an equal byte XORs to 0, which ends a hunk, so hunks are maximal runs of differing bytes:
+ * a gap of n equal bytes costs the 0 plus vint(n - 1), the least v1 can spend on it.
+ *
+ * format v2:
+ * Magic: 'EPS\2' (4 bytes)
+ * Description: string (variable length)
+ * Original file size: vint
+ * Flags: vint (EPS_LZ77: payload is compressed)
+ * Number of hunks: vint
+ * ON CRC: uint32
+ * OFF CRC: uint32
+ * Hunk directory: in the order of offset, each hunk is
+ *   Gap: vint (from the end of the previous hunk)
+ *   Size: vint
+ *   OFF CRC: uint32
+ * Payload size: vint
+ * Payload: XOR bytes of all hunks in order, raw or BIOS LZ77
+ * Patch CRC: uint32
+ *
+ * note:
+ * the directory tells every hunk without reading the payload, and each hunk can be verified alone:
+ * CRC is linear, so the ON CRC of a hunk is its OFF CRC ^ CRC(XOR bytes) ^ CRC(as many 0s), not stored.
+ * close hunks are joined if the equal bytes between them, which XOR to 0, cost less than an entry.
+ *
+ * format v3:
+ * same with v2, each entry of directory is followed by
+ *   ON from: vint, 0 for a hunk of XOR bytes, or zigzag(ON from - offset) + 1 for a copy, then
+ *   OFF from: vint, zigzag(OFF from - offset)
+ *   ON CRC: uint32
+ * a moved block is copied instead of XOR, no bytes of it are in the payload:
+ * ON bytes are at `ON from` of the ROM when OFF, and OFF bytes are at `OFF from` of the ROM when ON.
+ * copies are found by a rolling hash of blocks of the other ROM, like "source copy" of BPS,
+ * and turned into XOR bytes for the state of the ROM before applying.
+ *
+ * eps_build writes v1 if it is not larger, which old tools can read.
  *
  * this tool is made for GBA, so file is always not huge.
  * we can read file into memory first.
  */
 
 #include "eps.h"
+#include "core/batch.h"
+#include "core/gba.h"
+#include "utils/crc32.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define _c(c) buf_ccat(buf, c)
 #define _wc(c) buf_wccat(buf, c)
@@ -32,53 +74,6 @@
 // EPS //
 /////////
 
-static inline u32 crc32_byte(u32 crc, u8 byte)
-{
-	static const u32 CRC32_table[] = {
-		0x00000000,0x77073096,0xEE0E612C,0x990951BA,0x076DC419,0x706AF48F,0xE963A535,0x9E6495A3,
-		0x0EDB8832,0x79DCB8A4,0xE0D5E91E,0x97D2D988,0x09B64C2B,0x7EB17CBD,0xE7B82D07,0x90BF1D91,
-		0x1DB71064,0x6AB020F2,0xF3B97148,0x84BE41DE,0x1ADAD47D,0x6DDDE4EB,0xF4D4B551,0x83D385C7,
-		0x136C9856,0x646BA8C0,0xFD62F97A,0x8A65C9EC,0x14015C4F,0x63066CD9,0xFA0F3D63,0x8D080DF5,
-		0x3B6E20C8,0x4C69105E,0xD56041E4,0xA2677172,0x3C03E4D1,0x4B04D447,0xD20D85FD,0xA50AB56B,
-		0x35B5A8FA,0x42B2986C,0xDBBBC9D6,0xACBCF940,0x32D86CE3,0x45DF5C75,0xDCD60DCF,0xABD13D59,
-		0x26D930AC,0x51DE003A,0xC8D75180,0xBFD06116,0x21B4F4B5,0x56B3C423,0xCFBA9599,0xB8BDA50F,
-		0x2802B89E,0x5F058808,0xC60CD9B2,0xB10BE924,0x2F6F7C87,0x58684C11,0xC1611DAB,0xB6662D3D,
-		0x76DC4190,0x01DB7106,0x98D220BC,0xEFD5102A,0x71B18589,0x06B6B51F,0x9FBFE4A5,0xE8B8D433,
-		0x7807C9A2,0x0F00F934,0x9609A88E,0xE10E9818,0x7F6A0DBB,0x086D3D2D,0x91646C97,0xE6635C01,
-		0x6B6B51F4,0x1C6C6162,0x856530D8,0xF262004E,0x6C0695ED,0x1B01A57B,0x8208F4C1,0xF50FC457,
-		0x65B0D9C6,0x12B7E950,0x8BBEB8EA,0xFCB9887C,0x62DD1DDF,0x15DA2D49,0x8CD37CF3,0xFBD44C65,
-		0x4DB26158,0x3AB551CE,0xA3BC0074,0xD4BB30E2,0x4ADFA541,0x3DD895D7,0xA4D1C46D,0xD3D6F4FB,
-		0x4369E96A,0x346ED9FC,0xAD678846,0xDA60B8D0,0x44042D73,0x33031DE5,0xAA0A4C5F,0xDD0D7CC9,
-		0x5005713C,0x270241AA,0xBE0B1010,0xC90C2086,0x5768B525,0x206F85B3,0xB966D409,0xCE61E49F,
-		0x5EDEF90E,0x29D9C998,0xB0D09822,0xC7D7A8B4,0x59B33D17,0x2EB40D81,0xB7BD5C3B,0xC0BA6CAD,
-		0xEDB88320,0x9ABFB3B6,0x03B6E20C,0x74B1D29A,0xEAD54739,0x9DD277AF,0x04DB2615,0x73DC1683,
-		0xE3630B12,0x94643B84,0x0D6D6A3E,0x7A6A5AA8,0xE40ECF0B,0x9309FF9D,0x0A00AE27,0x7D079EB1,
-		0xF00F9344,0x8708A3D2,0x1E01F268,0x6906C2FE,0xF762575D,0x806567CB,0x196C3671,0x6E6B06E7,
-		0xFED41B76,0x89D32BE0,0x10DA7A5A,0x67DD4ACC,0xF9B9DF6F,0x8EBEEFF9,0x17B7BE43,0x60B08ED5,
-		0xD6D6A3E8,0xA1D1937E,0x38D8C2C4,0x4FDFF252,0xD1BB67F1,0xA6BC5767,0x3FB506DD,0x48B2364B,
-		0xD80D2BDA,0xAF0A1B4C,0x36034AF6,0x41047A60,0xDF60EFC3,0xA867DF55,0x316E8EEF,0x4669BE79,
-		0xCB61B38C,0xBC66831A,0x256FD2A0,0x5268E236,0xCC0C7795,0xBB0B4703,0x220216B9,0x5505262F,
-		0xC5BA3BBE,0xB2BD0B28,0x2BB45A92,0x5CB36A04,0xC2D7FFA7,0xB5D0CF31,0x2CD99E8B,0x5BDEAE1D,
-		0x9B64C2B0,0xEC63F226,0x756AA39C,0x026D930A,0x9C0906A9,0xEB0E363F,0x72076785,0x05005713,
-		0x95BF4A82,0xE2B87A14,0x7BB12BAE,0x0CB61B38,0x92D28E9B,0xE5D5BE0D,0x7CDCEFB7,0x0BDBDF21,
-		0x86D3D2D4,0xF1D4E242,0x68DDB3F8,0x1FDA836E,0x81BE16CD,0xF6B9265B,0x6FB077E1,0x18B74777,
-		0x88085AE6,0xFF0F6A70,0x66063BCA,0x11010B5C,0x8F659EFF,0xF862AE69,0x616BFFD3,0x166CCF45,
-		0xA00AE278,0xD70DD2EE,0x4E048354,0x3903B3C2,0xA7672661,0xD06016F7,0x4969474D,0x3E6E77DB,
-		0xAED16A4A,0xD9D65ADC,0x40DF0B66,0x37D83BF0,0xA9BCAE53,0xDEBB9EC5,0x47B2CF7F,0x30B5FFE9,
-		0xBDBDF21C,0xCABAC28A,0x53B39330,0x24B4A3A6,0xBAD03605,0xCDD70693,0x54DE5729,0x23D967BF,
-		0xB3667A2E,0xC4614AB8,0x5D681B02,0x2A6F2B94,0xB40BBE37,0xC30C8EA1,0x5A05DF1B,0x2D02EF8D
-	};
-	return (crc >> 8) ^ CRC32_table[(crc ^ byte) & 0xFF];
-}
-
-static u32 crc32(const u8 *data, u32 size)
-{
-	u32 crc = 0xFFFFFFFF;
-	for (u32 i = 0; i < size; ++i)
-		crc = crc32_byte(crc, *data++);
-	return crc ^ 0xFFFFFFFF;
-}
-
 static u32 vint(const u8 **pp, const u8 *end)
 {
 	const u8 *p = *pp;
@@ -110,19 +105,578 @@ static void build_vint(buf_t *buf, u32 x)
 	}
 }
 
+/* vint of v2, false if truncated or longer than 32 bits */
+static bool read_vint(const u8 **pp, const u8 *end, u32 *x)
+{
+	const u8 *p = *pp;
+	for (u32 i = 0; i < 5 && p + i < end; ++i) {
+		if (p[i] & 0x80) {
+			*x = vint(pp, end);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool read_u32(const u8 **pp, const u8 *end, u32 *x)
+{
+	if (end - *pp < 4)
+		return false;
+	memcpy(x, *pp, 4);
+	*pp += 4;
+	return true;
+}
+
+/* bytes of vint */
+static u32 vint_size(u32 x)
+{
+	u32 n = 1;
+	while (x >>= 7) {
+		--x;
+		++n;
+	}
+	return n;
+}
+
+/* signed offsets of v3 */
+static inline u32 zigzag(s32 x)
+{
+	return (u32)x << 1 ^ (u32)(x >> 31);
+}
+
+static inline s32 unzigzag(u32 x)
+{
+	return (s32)(x >> 1) ^ -(s32)(x & 1);
+}
+
+/* CRC of n 0s, so that CRC(a ^ b) = CRC(a) ^ CRC(b) ^ CRC(0s) for a and b of n bytes */
+static u32 crc32_zeros(u32 n)
+{
+	static const u8 zeros[0x400];
+	u32 crc = 0;
+	for (; n > sizeof(zeros); n -= sizeof(zeros))
+		crc = crc32(crc, zeros, sizeof(zeros));
+	return crc32(crc, zeros, n);
+}
+
+/* hand over the data of a buffer, which is freed */
+static void *buf_take(buf_t *B, u32 elem_size, u32 *num)
+{
+	void *data = B->buf;
+	*num = B->size / elem_size;
+	free(B);
+	return data;
+}
+
+/**
+ * a hunk of XOR bytes ends with 0, or at the end of patch or ROM, where the 0 is not read.
+ * return its XOR bytes and size, `*pp` and `*pof` are moved past it
+ */
+static const u8 *next_hunk(const u8 **pp, const u8 *end, u32 *pof, u32 rom_size, u32 *pn)
+{
+	const u8 *p = *pp, *z;
+#ifdef __SSE2__
+	// most hunks are short, found by one compare without branching per byte
+	if (end - p >= 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)p);
+		u32 m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+		z = m ? p + __builtin_ctz(m) : memchr(p + 16, 0, end - p - 16);
+	} else
+#endif
+	z = memchr(p, 0, end - p);
+	u32 len = z ? z - p : end - p, room = rom_size - *pof;
+	*pn = len < room ? len : room;
+	u32 used = z && len < room ? len + 1 : *pn;
+	*pp = p + used;
+	*pof += used;
+	return p;
+}
+
+/**
+ * CRC over the bytes of many small hunks, gathered to be checksummed in blocks
+ */
+typedef struct hunk_crc_t {
+	u32 crc;
+	u32 size;
+	u8 buf[0x1000];
+} hunk_crc_t;
+
+static void hunk_crc_flush(hunk_crc_t *C)
+{
+	C->crc = crc32(C->crc, C->buf, C->size);
+	C->size = 0;
+}
+
+static void hunk_crc(hunk_crc_t *C, const u8 *data, u32 n)
+{
+	if (C->size + n > sizeof(C->buf)) {
+		hunk_crc_flush(C);
+		if (n > sizeof(C->buf) / 2) {
+			C->crc = crc32(C->crc, data, n);
+			return;
+		}
+	}
+	u8 *d = C->buf + C->size;
+	for (u32 i = 0; i < n; ++i) // mostly a few bytes, not worth a call
+		d[i] = data[i];
+	C->size += n;
+}
+
 /**
- * check if the patch is an EPS patch
+ * grow the buffer to `size`, new bytes are 0xFF
  */
-static bool check_eps(const u8 *patch, u32 size)
+static bool grow(u8 **r, u32 *s, u32 size)
 {
-	if (size < 20 || patch[0] != 'E' || patch[1] != 'P' || patch[2] != 'S' || patch[3] != '\x1')
+	if (*r == ROM) { // may be mapped
+		if (!resize_ROM(size))
+			return false;
+		*r = ROM;
+		*s = ROM_size;
+		return true;
+	}
+	u8 *rom = realloc(*r, size);
+	if (!rom)
 		return false;
+	memset(rom + *s, 0xFF, size - *s);
+	*r = rom;
+	*s = size;
+	return true;
+}
+
+#define EPS_LZ77 0x1 /* v2 flag: payload is compressed */
+#define EPS_NO_COPY 0xFFFFFFFF /* from of a hunk of XOR bytes, while building or reading v3 */
+
+/**
+ * check if the patch is an EPS patch
+ * @return version, 0 if it isn't or is corrupted
+ */
+static int eps_version(const u8 *patch, u32 size)
+{
+	if (size < 20 || patch[0] != 'E' || patch[1] != 'P' || patch[2] != 'S' || patch[3] < 1 || patch[3] > 3)
+		return 0;
 	u32 crc = *(u32*)(patch + size - 4);
-	if (crc32(patch, size - 4) != crc) // check if patch is corrupted
+	if (crc32(0, patch, size - 4) != crc) // check if patch is corrupted
+		return 0;
+	return patch[3];
+}
+
+///////////
+// apply //
+///////////
+
+typedef struct eps_cursor_t {
+	eps_patch_t *patch;
+	const eps_index_t *index; // parsed patch, NULL if read from v1 patch data
+	u32 order; // of patch, which goes first at the same offset
+	const eps_hunk_t *h, *h_end; // hunks left in index, or
+	const u8 *p, *end; // hunks left in patch data
+	u32 of; // offset after the hunk read from patch data
+	u32 at, size; // current hunk
+	const u8 *x; // XOR bytes of current hunk
+	u32 dst_size;
+	u32 on_crc, off_crc;
+	hunk_crc_t C;
+} eps_cursor_t;
+
+static bool cursor_init(eps_cursor_t *c, eps_patch_t *P, const eps_index_t *index, u32 order)
+{
+	c->patch = P;
+	c->index = index;
+	c->order = order;
+	c->C.crc = c->C.size = 0;
+	if (index) {
+		c->h = index->hunks;
+		c->h_end = c->h + index->num;
+		c->dst_size = index->dst_size;
+		c->on_crc = index->on_crc;
+		c->off_crc = index->off_crc;
+		return true;
+	}
+	if (eps_version(P->data, P->size) != 1)
 		return false;
+	c->h = NULL;
+	c->p = P->data + 4;
+	c->end = P->data + P->size - 12;
+	c->on_crc = *(u32*)(c->end + 0);
+	c->off_crc = *(u32*)(c->end + 4);
+	c->p += strlen((const char*)c->p) + 1; // skip description
+	c->dst_size = vint(&c->p, c->end);
+	c->of = 0;
 	return true;
 }
 
+/* move to the next hunk, false if there is none */
+static bool cursor_next(eps_cursor_t *c)
+{
+	if (c->h) {
+		if (c->h == c->h_end)
+			return false;
+		c->at = c->h->offset;
+		c->size = c->h->size;
+		c->x = c->h->data;
+		++c->h;
+		return true;
+	}
+	if (c->p >= c->end)
+		return false;
+	c->of += vint(&c->p, c->end);
+	if (c->of >= c->dst_size) // nothing left, the 0 ending a hunk at the end is not read
+		return false;
+	c->at = c->of;
+	c->x = next_hunk(&c->p, c->end, &c->of, c->dst_size, &c->size);
+	return true;
+}
+
+static inline bool cursor_less(const eps_cursor_t *a, const eps_cursor_t *b)
+{
+	return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+static void heap_down(eps_cursor_t **heap, u32 num, u32 i)
+{
+	eps_cursor_t *c = heap[i];
+	for (u32 k; (k = i * 2 + 1) < num; i = k) {
+		if (k + 1 < num && cursor_less(heap[k + 1], heap[k]))
+			++k;
+		if (!cursor_less(heap[k], c))
+			break;
+		heap[i] = heap[k];
+	}
+	heap[i] = c;
+}
+
+/**
+ * go through hunks of all patches in the order of offset,
+ * return false if hunks of different patches overlap
+ */
+static bool sweep(u8 *rom, eps_cursor_t *cursors, u32 num, eps_cursor_t **heap)
+{
+	u32 n = 0;
+	for (u32 i = 0; i < num; ++i) {
+		if (cursor_next(&cursors[i]))
+			heap[n++] = &cursors[i];
+	}
+	for (u32 i = n / 2; i--; )
+		heap_down(heap, n, i);
+
+	bool overlap = false;
+	u32 last_end = 0, last = 0; // the furthest end of hunks and its patch
+	u32 dirty = 0, dirty_end = 0; // modified range not marked yet
+	while (n) {
+		eps_cursor_t *c = heap[0];
+		bool apply = !c->patch->check, more;
+		if (c->at < last_end && c->order != last)
+			overlap = true;
+		// hunks of the first patch, till another patch comes first
+		u32 limit = n > 1 ? heap[1]->at : -1;
+		if (n > 2 && heap[2]->at < limit)
+			limit = heap[2]->at;
+		do {
+			u32 at = c->at, size = c->size;
+			u8 *q = rom + at;
+			const u8 *x = c->x;
+			if (apply) {
+				for (u32 i = 0; i < size; ++i)
+					q[i] ^= x[i];
+				// close hunks are marked at once, no page lies between them
+				if (at >= dirty_end + ROM_PAGE_SIZE) {
+					if (rom == ROM)
+						mark_ROM(dirty, dirty_end - dirty);
+					dirty = at;
+				}
+				if (at + size > dirty_end)
+					dirty_end = at + size;
+			}
+			hunk_crc(&c->C, q, size);
+			if (at + size > last_end) {
+				last_end = at + size;
+				last = c->order;
+			}
+		} while ((more = cursor_next(c)) && c->at < limit);
+		if (!more)
+			heap[0] = heap[--n];
+		if (n)
+			heap_down(heap, n, 0);
+	}
+	if (rom == ROM)
+		mark_ROM(dirty, dirty_end - dirty);
+	return !overlap;
+}
+
+/**
+ * XOR bytes of copied hunks, from the ROM in the state it is in now.
+ * bytes to copy are checked by the CRC of their hunk in the other state, before anything is written.
+ * @return malloc'd index without copies, NULL if the ROM is in neither state or a copy doesn't match
+ */
+static eps_index_t *resolve_copies(const eps_index_t *I, const u8 *rom)
+{
+	hunk_crc_t C = {0};
+	size_t payload = strlen(I->desc) + 1;
+	for (u32 i = 0; i < I->num; ++i) {
+		hunk_crc(&C, rom + I->hunks[i].offset, I->hunks[i].size);
+		payload += I->hunks[i].size;
+	}
+	hunk_crc_flush(&C);
+	if (C.crc != I->on_crc && C.crc != I->off_crc)
+		return NULL;
+	bool on = C.crc == I->on_crc;
+	eps_index_t *R = malloc(sizeof(*R) + I->num * sizeof(eps_hunk_t) + payload);
+	if (!R)
+		return NULL;
+	*R = *I;
+	R->copies = 0;
+	u8 *d = (u8*)(R->hunks + I->num);
+	for (u32 i = 0; i < I->num; ++i) {
+		const eps_hunk_t *h = &I->hunks[i];
+		R->hunks[i] = *h;
+		R->hunks[i].data = d;
+		if (h->data) {
+			memcpy(d, h->data, h->size);
+		} else {
+			const u8 *from = rom + (on ? h->off_from : h->on_from), *q = rom + h->offset;
+			if (crc32(0, from, h->size) != (on ? h->off_crc : h->on_crc)) {
+				free(R);
+				return NULL;
+			}
+			for (u32 k = 0; k < h->size; ++k)
+				d[k] = q[k] ^ from[k];
+		}
+		d += h->size;
+	}
+	R->desc = strcpy((char*)d, I->desc);
+	return R;
+}
+
+/**
+ * apply or check many patches in one pass over the ROM, in the order of offset.
+ * the result of each patch is the same as applying them one by one in order.
+ * @param r       pointer to ROM buffer, grown to the largest size of patches
+ * @param s       ROM size
+ * @param patches `result` is 1/0 for ON/OFF, 2 if it doesn't match the ROM, -1 if corrupted
+ * @param num     number of patches
+ * @return false if the ROM can't be grown or out of memory
+ */
+bool eps_apply_many(u8 **r, u32 *s, eps_patch_t *patches, u32 num)
+{
+	for (u32 i = 0; i < num; ++i)
+		patches[i].result = -1;
+	// bytes to copy may be modified by patches before, so apply (or check) one by one
+	for (u32 i = 0; num > 1 && i < num; ++i) {
+		const eps_patch_t *P = &patches[i];
+		if (P->index ? P->index->copies : P->size >= 4 && P->data[3] == '\x3') {
+			bool ok = true;
+			for (u32 k = 0; k < num; ++k)
+				ok &= eps_apply_many(r, s, &patches[k], 1);
+			return ok;
+		}
+	}
+	eps_cursor_t *cursors = malloc(num * sizeof(*cursors));
+	eps_cursor_t **heap = malloc(num * sizeof(*heap));
+	eps_index_t **parsed = calloc(num, sizeof(*parsed)); // v2 patches given by data
+	bool ok = cursors && heap && parsed;
+	if (!ok)
+		goto clean;
+
+	u32 n = 0, dst_size = *s;
+	bool apply = false;
+	for (u32 i = 0; i < num; ++i) {
+		eps_patch_t *P = &patches[i];
+		const eps_index_t *index = P->index;
+		if (!index && P->size >= 4 && P->data[3] != '\x1') // v2, v3
+			index = parsed[i] = eps_index(P->data, P->size);
+		if (!cursor_init(&cursors[n], P, index, i))
+			continue;
+		if (cursors[n].dst_size > dst_size)
+			dst_size = cursors[n].dst_size;
+		apply |= !patches[i].check;
+		++n;
+	}
+	if (dst_size > *s && !grow(r, s, dst_size)) {
+		ok = false;
+		goto clean;
+	}
+	eps_cursor_t *c = &cursors[0];
+	if (n == 1 && c->index && c->index->copies) { // the only patch, see above
+		eps_index_t *R = resolve_copies(c->index, *r);
+		if (!R) {
+			c->patch->result = 2;
+			goto clean;
+		}
+		free(parsed[c->order]);
+		parsed[c->order] = R;
+		cursor_init(c, c->patch, R, c->order);
+	}
+
+	if (!sweep(*r, cursors, n, heap) && apply) {
+		// a patch saw bytes of overlapping patches after it in order,
+		// undo them (XOR again) and apply one by one
+		for (u32 i = 0; i < n; ++i)
+			cursor_init(&cursors[i], cursors[i].patch, cursors[i].index, cursors[i].order);
+		sweep(*r, cursors, n, heap);
+		for (u32 i = 0; i < n; ++i) {
+			cursor_init(&cursors[i], cursors[i].patch, cursors[i].index, cursors[i].order);
+			sweep(*r, &cursors[i], 1, heap);
+		}
+	}
+
+	for (u32 i = 0; i < n; ++i) {
+		eps_cursor_t *c = &cursors[i];
+		hunk_crc_flush(&c->C);
+		if (c->C.crc == c->on_crc)
+			c->patch->result = 1;
+		else if (c->C.crc == c->off_crc)
+			c->patch->result = 0;
+		else
+			c->patch->result = 2;
+	}
+clean:
+	for (u32 i = 0; parsed && i < num; ++i)
+		free(parsed[i]);
+	free(cursors);
+	free(heap);
+	free(parsed);
+	return ok;
+}
+
+/* v2/v3: hunks are read from the directory, the payload is uncompressed at once */
+static eps_index_t *index_v2(const u8 *patch, u32 size)
+{
+	bool v3 = patch[3] == 3;
+	const u8 *end = patch + size - 4, *z = memchr(patch + 4, 0, end - patch - 4);
+	if (!z)
+		return NULL;
+	const u8 *p = z + 1;
+	u32 dst_size, flags, num, on_crc, off_crc;
+	if (!read_vint(&p, end, &dst_size) || !read_vint(&p, end, &flags) || !read_vint(&p, end, &num)
+		|| !read_u32(&p, end, &on_crc) || !read_u32(&p, end, &off_crc))
+		return NULL;
+	if (num > (end - p) / 6) // an entry takes 6 bytes at least
+		return NULL;
+	eps_hunk_t *hunks = malloc((num + 1) * sizeof(*hunks));
+	if (!hunks)
+		return NULL;
+	// hunks are in order and inside the ROM, so are copies
+	u32 payload = 0, last = 0, copies = 0, stored = 0;
+	for (u32 i = 0; i < num; ++i) {
+		eps_hunk_t *h = &hunks[i];
+		u32 gap, n, on_from = 0, off_from;
+		if (!read_vint(&p, end, &gap) || !read_vint(&p, end, &n) || !read_u32(&p, end, &h->off_crc)
+			|| (v3 && !read_vint(&p, end, &on_from)))
+			goto fail;
+		if (gap > dst_size - last || n > dst_size - last - gap)
+			goto fail;
+		h->offset = last + gap;
+		h->size = n;
+		h->data = NULL;
+		h->on_from = h->off_from = EPS_NO_COPY;
+		last = h->offset + n;
+		if (!on_from) {
+			payload += n;
+			continue;
+		}
+		if (!read_vint(&p, end, &off_from) || !read_u32(&p, end, &h->on_crc))
+			goto fail;
+		h->on_from = h->offset + unzigzag(on_from - 1);
+		h->off_from = h->offset + unzigzag(off_from);
+		if (h->on_from > dst_size - n || h->off_from > dst_size - n)
+			goto fail;
+		++copies;
+	}
+	if (!read_vint(&p, end, &stored) || stored != end - p)
+		goto fail;
+	if (flags & EPS_LZ77 ? stored < 4 || (p[0] & 0xF0) != 0x10 || *(const u32*)p >> 8 != payload : stored != payload)
+		goto fail;
+
+	size_t desc_len = z - patch - 4 + 1;
+	eps_index_t *I = malloc(sizeof(*I) + num * sizeof(eps_hunk_t) + payload + desc_len);
+	if (!I)
+		goto fail;
+	u8 *d = (u8*)(I->hunks + num);
+	if (!(flags & EPS_LZ77))
+		memcpy(d, p, payload);
+	else if (!LZ77UnCompSafe(d, p, stored, &payload)) {
+		free(I);
+		goto fail;
+	}
+	I->dst_size = dst_size;
+	I->on_crc = on_crc;
+	I->off_crc = off_crc;
+	I->crc = *(u32*)end;
+	I->version = patch[3];
+	I->copies = copies;
+	I->num = num;
+	for (u32 i = 0; i < num; ++i) {
+		eps_hunk_t *h = &I->hunks[i];
+		*h = hunks[i];
+		if (h->on_from == EPS_NO_COPY) {
+			h->data = d;
+			h->on_crc = h->off_crc ^ crc32(0, d, h->size) ^ crc32_zeros(h->size);
+			h->on_from = h->off_from = 0;
+			d += h->size;
+		}
+	}
+	I->desc = memcpy(d, patch + 4, desc_len);
+	free(hunks);
+	return I;
+fail:
+	free(hunks);
+	return NULL;
+}
+
+/**
+ * parse the patch into a table of hunks, to be applied without reading it again
+ * @return malloc'd index (XOR bytes and description are copied), NULL if corrupted
+ */
+eps_index_t *eps_index(const u8 *patch, u32 size)
+{
+	if (eps_version(patch, size) >= 2)
+		return index_v2(patch, size);
+	eps_patch_t P = {.data = patch, .size = size};
+	eps_cursor_t c;
+	if (!cursor_init(&c, &P, NULL, 0))
+		return NULL;
+	u32 num = 0;
+	size_t payload = strlen((const char*)patch + 4) + 1;
+	while (cursor_next(&c)) {
+		++num;
+		payload += c.size;
+	}
+	eps_index_t *I = malloc(sizeof(*I) + num * sizeof(eps_hunk_t) + payload);
+	if (!I)
+		return NULL;
+	u8 *d = (u8*)(I->hunks + num);
+	cursor_init(&c, &P, NULL, 0);
+	I->dst_size = c.dst_size;
+	I->on_crc = c.on_crc;
+	I->off_crc = c.off_crc;
+	I->crc = *(u32*)(patch + size - 4);
+	I->version = 1;
+	I->copies = 0;
+	I->num = num;
+	for (u32 i = 0; cursor_next(&c); ++i) {
+		I->hunks[i] = (eps_hunk_t){c.at, c.size, d};
+		memcpy(d, c.x, c.size);
+		d += c.size;
+	}
+	I->desc = strcpy((char*)d, (const char*)patch + 4);
+	return I;
+}
+
+/**
+ * check a hunk against the ROM alone, by its CRCs
+ * @return 1/0 for ON/OFF, 2 if it doesn't match the ROM, -1 if the patch has no CRCs of hunks (v1)
+ */
+int eps_check_hunk(const u8 *rom, u32 rom_size, const eps_index_t *index, u32 i)
+{
+	if (index->version < 2)
+		return -1;
+	const eps_hunk_t *h = &index->hunks[i];
+	if (h->offset > rom_size || h->size > rom_size - h->offset)
+		return 2;
+	u32 crc = crc32(0, rom + h->offset, h->size);
+	return crc == h->on_crc ? 1 : crc == h->off_crc ? 0 : 2;
+}
+
 /**
  * apply the patch to the ROM
  * @param r          pointer to ROM buffer (we need to modify it if dest size is greater than src size)
@@ -133,93 +687,305 @@ static bool check_eps(const u8 *patch, u32 size)
  */
 int eps_apply(u8 **r, u32 *s, const u8 *patch, u32 patch_size)
 {
-	if (!check_eps(patch, patch_size))
-		return -1;
+	eps_patch_t P = {.data = patch, .size = patch_size};
+	eps_apply_many(r, s, &P, 1);
+	return P.result;
+}
 
-	const u8 *p = patch + 4, *end = patch + patch_size - 12;
-	u8 *rom = *r;
-	s32 size = *s;
+int eps_check(u8 **r, u32 *s, const u8 *patch, u32 patch_size)
+{
+	eps_patch_t P = {.data = patch, .size = patch_size, .check = true};
+	eps_apply_many(r, s, &P, 1);
+	return P.result;
+}
 
-	u32 on_crc = *(u32*)(end + 0);
-	u32 off_crc = *(u32*)(end + 4);
+///////////
+// build //
+///////////
 
-	p += strlen((const char*)p) + 1; // skip description
-	u32 dst_size = vint(&p, end);
+#define DIFF_CHUNK 0x100000 /* minimum bytes diffed by a thread */
 
-	if (dst_size > size) {
-		rom = realloc(rom, dst_size);
-		memset(rom, 0xFF, dst_size - size);
-		*r = rom;
-		*s = dst_size;
+// length of the run where a and b are equal (eq) or differ (!eq)
+static u32 run_len(const u8 *a, const u8 *b, u32 n, bool eq)
+{
+	u32 i = 0;
+#ifdef __SSE2__
+	// bits of cmpeq mask are flipped, so a set bit ends the run
+	const u32 flip = eq ? 0xFFFF : 0;
+	for (; i + 64 <= n; i += 64) {
+		u64 m = 0;
+		for (int k = 0; k < 64; k += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(a + i + k));
+			__m128i y = _mm_loadu_si128((const __m128i*)(b + i + k));
+			m |= (u64)(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ flip) << k;
+		}
+		if (m)
+			return i + __builtin_ctzll(m);
+	}
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+		u32 m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ flip;
+		if (m)
+			return i + __builtin_ctz(m);
 	}
+#endif
+	while (i < n && (a[i] == b[i]) == eq)
+		++i;
+	return i;
+}
 
-	u8 *rom_end = rom + dst_size;
-	u32 of = 0;
-	u32 crc = 0xFFFFFFFF;
-	while (p < end) {
-		of += vint(&p, end);
-		if (of > dst_size)
+typedef struct diff_task_t {
+	const u8 *src, *dest;
+	u32 begin, end; // range to diff
+	buf_t *hunks; // u32 pairs: offset, size
+	u32 hunk_size; // sum of hunk sizes
+	u32 on_crc, off_crc; // over hunks of this range
+} diff_task_t;
+
+/* find maximal runs of differing bytes, the same as hunks of a serial diff */
+static void *diff_main(void *arg)
+{
+	diff_task_t *T = arg;
+	for (u32 i = T->begin; i < T->end; ) {
+		i += run_len(T->src + i, T->dest + i, T->end - i, true);
+		if (i >= T->end)
 			break;
-		u8 *q = rom + of;
-		for (int x; p < end && q < rom_end && (++of, x = *p++); )
-			crc = crc32_byte(crc, *q++ ^= x);
-	}
-	crc ^= 0xFFFFFFFF;
-
-	int result;
-	if (crc == on_crc)
-		result = 1;
-	else if (crc == off_crc)
-		result = 0;
-	else
-		result = 2;
-	return result;
+		u32 n = run_len(T->src + i, T->dest + i, T->end - i, false);
+		u32 h[2] = {i, n};
+		buf_mcat(T->hunks, h, sizeof(h));
+		T->hunk_size += n;
+		T->on_crc = crc32(T->on_crc, T->dest + i, n);
+		T->off_crc = crc32(T->off_crc, T->src + i, n);
+		i += n;
+	}
+	return NULL;
 }
 
-int eps_check(u8 **r, u32 *s, const u8 *patch, u32 patch_size)
+static void build_hunk(buf_t *buf, const u8 *src, const u8 *dest, u32 offset, u32 size, u32 of)
 {
-	if (!check_eps(patch, patch_size))
-		return -1;
+	build_vint(buf, offset - of);
+	u8 x[256];
+	for (u32 i = offset, end = offset + size; i < end; ) {
+		u32 n = end - i < sizeof(x) ? end - i : sizeof(x);
+		for (u32 k = 0; k < n; ++k, ++i)
+			x[k] = src[i] ^ dest[i];
+		_m(x, n);
+	}
+	_c(0);
+}
 
-	const u8 *p = patch + 4, *end = patch + patch_size - 12;
-	u8 *rom = *r;
-	s32 size = *s;
+/* hunks are u32 pairs: offset, size */
+static void build_v1(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc, const u32 *h, u32 num,
+	u32 on_crc, u32 off_crc)
+{
+	_s("EPS\x1"); // magic
+	_s(desc); _c(0); // description
+	build_vint(buf, size); // ROM size
+	u32 of = 0;
+	for (u32 i = 0; i < num; ++i, h += 2) {
+		build_hunk(buf, src, dest, h[0], h[1], of);
+		of = h[0] + h[1] + 1; // the byte after a hunk is equal and skipped
+	}
+	_m(&on_crc, 4); // ON CRC
+	_m(&off_crc, 4); // OFF CRC
+}
 
-	u32 on_crc = *(u32*)(end + 0);
-	u32 off_crc = *(u32*)(end + 4);
+/* hunks of v2/v3 directory: offset, size, ON CRC, OFF CRC, ON from, OFF from */
+#define V3_WORDS 6
 
-	p += strlen((const char*)p) + 1; // skip description
-	u32 dst_size = vint(&p, end);
+/**
+ * join close hunks into entries of directory, which are XOR.
+ * a hunk is joined to the entry before if the equal bytes between them cost less than its entry:
+ * 0s cost a byte each in raw payload, and about 2 bytes per 18 in LZ77 (a match of the 0 before).
+ */
+static u32 *join_hunks(const u32 *h, u32 num, bool lz, u32 *pn)
+{
+	u32 *dir = malloc((num + 1) * V3_WORDS * sizeof(*dir)), *e = NULL;
+	u32 n = 0;
+	for (u32 i = 0; i < num; ++i, h += 2) {
+		u32 gap = e ? h[0] - (e[0] + e[1]) : 0;
+		u32 zeros = lz && gap >= 3 ? (gap + 17) / 18 * 2 + 1 : gap;
+		if (e && zeros <= vint_size(gap) + vint_size(h[1]) + 4) {
+			e[1] = h[0] + h[1] - e[0];
+			continue;
+		}
+		e = dir + n++ * V3_WORDS;
+		e[0] = h[0];
+		e[1] = h[1];
+		e[4] = e[5] = EPS_NO_COPY;
+	}
+	*pn = n;
+	return dir;
+}
+
+#define COPY_BLOCK 32 /* bytes hashed to find a copy */
+#define COPY_MIN 32 /* shorter copies cost more than their XOR bytes */
+#define COPY_MUL 0x01000193 /* of rolling hash */
+
+typedef struct copy_t {
+	u32 offset, from, size;
+} copy_t;
+
+static u32 block_hash(const u8 *p)
+{
+	u32 h = 0;
+	for (int i = 0; i < COPY_BLOCK; ++i)
+		h = h * COPY_MUL + p[i];
+	return h;
+}
+
+/**
+ * find bytes of `to` in the entries, which are in `from` at another offset.
+ * blocks of `from` are put in a hash table, which is looked up by the rolling hash of `to` at each byte.
+ * @return copies in the order of offset
+ */
+static buf_t *find_copies(const u8 *to, const u8 *from, u32 size, const u32 *dir, u32 num)
+{
+	buf_t *copies = new_buf(0);
+	u32 bits = 10;
+	while (bits < 30 && (1u << bits) < size / COPY_BLOCK * 2)
+		++bits;
+	u32 *table = calloc(1u << bits, sizeof(*table)); // offset + 1 of a block
+	if (!table)
+		return copies;
+	for (u32 p = 0; p + COPY_BLOCK <= size; p += COPY_BLOCK)
+		table[block_hash(from + p) * 0x9E3779B1 >> (32 - bits)] = p + 1;
+	u32 out_mul = 1; // of the byte rolled out
+	for (int i = 1; i < COPY_BLOCK; ++i)
+		out_mul *= COPY_MUL;
 
-	if (dst_size > size) {
-		rom = realloc(rom, dst_size);
-		memset(rom, 0xFF, dst_size - size);
-		*r = rom;
-		*s = dst_size;
+	for (const u32 *e = dir; e < dir + num * V3_WORDS; e += V3_WORDS) {
+		u32 last = e[0], end = e[0] + e[1]; // last: end of the previous copy
+		u32 h = 0;
+		bool rehash = true;
+		for (u32 i = e[0]; i + COPY_BLOCK <= end; ) {
+			if (rehash)
+				h = block_hash(to + i);
+			rehash = false;
+			u32 q = table[h * 0x9E3779B1 >> (32 - bits)];
+			if (q && q - 1 != i && !memcmp(to + i, from + q - 1, COPY_BLOCK)) {
+				u32 a = i;
+				for (--q; a > last && q && to[a - 1] == from[q - 1]; --a, --q);
+				u32 n = run_len(to + a, from + q, end - a < size - q ? end - a : size - q, true);
+				if (n >= COPY_MIN) {
+					copy_t c = {a, q, n};
+					buf_mcat(copies, &c, sizeof(c));
+					i = last = a + n;
+					rehash = true;
+					continue;
+				}
+			}
+			if (i + COPY_BLOCK < end)
+				h = (h - to[i] * out_mul) * COPY_MUL + to[i + COPY_BLOCK];
+			++i;
+		}
 	}
+	free(table);
+	return copies;
+}
 
-	u8 *rom_end = rom + dst_size;
-	u32 of = 0;
-	u32 crc = 0xFFFFFFFF;
-	while (p < end) {
-		of += vint(&p, end);
-		if (of > dst_size)
-			break;
-		u8 *q = rom + of;
-		for (; p < end && q < rom_end && (++of, *p++); )
-			crc = crc32_byte(crc, *q++);
-	}
-	crc ^= 0xFFFFFFFF;
-
-	int result;
-	if (crc == on_crc)
-		result = 1;
-	else if (crc == off_crc)
-		result = 0;
-	else
-	 	result = 2;
-check_fail:
-	return result;
+/**
+ * split entries where bytes can be copied both ways: ON bytes from the source, and OFF bytes from the dest.
+ * XOR bytes are still needed if only one way is a copy.
+ */
+static u32 *split_copies(const u8 *src, u32 size, const u8 *dest, u32 *dir, u32 *pn)
+{
+	buf_t *fwd = find_copies(dest, src, size, dir, *pn), *bwd = find_copies(src, dest, size, dir, *pn);
+	const copy_t *F = (const copy_t*)fwd->buf, *F_end = F + fwd->size / sizeof(*F);
+	const copy_t *B = (const copy_t*)bwd->buf, *B_end = B + bwd->size / sizeof(*B);
+	buf_t *out = new_buf(0);
+	for (const u32 *e = dir; e < dir + *pn * V3_WORDS; e += V3_WORDS) {
+		u32 x[V3_WORDS] = {e[0], 0, 0, 0, EPS_NO_COPY, EPS_NO_COPY}; // pending XOR entry
+		for (u32 pos = e[0], end = e[0] + e[1], next; pos < end; pos = next) {
+			while (F < F_end && F->offset + F->size <= pos)
+				++F;
+			while (B < B_end && B->offset + B->size <= pos)
+				++B;
+			// till any copy begins or ends
+			bool f = F < F_end && F->offset <= pos, b = B < B_end && B->offset <= pos;
+			next = end;
+			if (F < F_end && (f ? F->offset + F->size : F->offset) < next)
+				next = f ? F->offset + F->size : F->offset;
+			if (B < B_end && (b ? B->offset + B->size : B->offset) < next)
+				next = b ? B->offset + B->size : B->offset;
+			if (!f || !b || next - pos < COPY_MIN) {
+				x[1] += next - pos;
+				continue;
+			}
+			if (x[1])
+				buf_mcat(out, x, sizeof(x));
+			u32 c[V3_WORDS] = {pos, next - pos, 0, 0, F->from + pos - F->offset, B->from + pos - B->offset};
+			buf_mcat(out, c, sizeof(c));
+			x[0] = next;
+			x[1] = 0;
+		}
+		if (x[1])
+			buf_mcat(out, x, sizeof(x));
+	}
+	del_buf(fwd);
+	del_buf(bwd);
+	free(dir);
+	return buf_take(out, V3_WORDS * sizeof(u32), pn);
+}
+
+/* v3 if any entry is copied */
+static void build_v2(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc, u32 *dir, u32 n, u32 flags)
+{
+	u32 payload = 0, copies = 0;
+	for (u32 *e = dir; e < dir + n * V3_WORDS; e += V3_WORDS) {
+		if (e[4] == EPS_NO_COPY)
+			payload += e[1];
+		else
+			++copies;
+	}
+	_s(copies ? "EPS\x3" : "EPS\x2"); // magic
+	_s(desc); _c(0); // description
+	// XOR bytes and CRCs
+	u32 on_crc = 0, off_crc = 0;
+	u8 *x = malloc(payload + 1), *z = NULL;
+	for (u32 *e = dir, k = 0; e < dir + n * V3_WORDS; e += V3_WORDS) {
+		for (u32 j = e[0]; e[4] == EPS_NO_COPY && j < e[0] + e[1]; ++j)
+			x[k++] = src[j] ^ dest[j];
+		e[2] = crc32(0, dest + e[0], e[1]);
+		e[3] = crc32(0, src + e[0], e[1]);
+		on_crc = crc32_combine(on_crc, e[2], e[1]);
+		off_crc = crc32_combine(off_crc, e[3], e[1]);
+	}
+	u32 stored = payload, lz = 0;
+	if ((flags & EPS_BUILD_LZ77) && payload && payload <= 0xFFFFFF) { // size in 24 bits
+		z = malloc(4 + payload + payload / 8 + 1);
+		u32 m = z ? LZ77CompEx(z, x, payload, true, LZ77_EFFORT_DEFAULT) : -1;
+		if (m < payload) { // only if smaller
+			stored = m;
+			lz = EPS_LZ77;
+		}
+	}
+	build_vint(buf, size); // ROM size
+	build_vint(buf, lz); // flags
+	build_vint(buf, n);
+	_m(&on_crc, 4);
+	_m(&off_crc, 4);
+	u32 last = 0;
+	for (u32 *e = dir; e < dir + n * V3_WORDS; e += V3_WORDS) { // directory
+		build_vint(buf, e[0] - last);
+		build_vint(buf, e[1]);
+		_m(&e[3], 4); // OFF CRC
+		last = e[0] + e[1];
+		if (!copies)
+			continue;
+		if (e[4] == EPS_NO_COPY) {
+			build_vint(buf, 0);
+			continue;
+		}
+		build_vint(buf, zigzag(e[4] - e[0]) + 1);
+		build_vint(buf, zigzag(e[5] - e[0]));
+		_m(&e[2], 4); // ON CRC
+	}
+	build_vint(buf, stored);
+	_m(lz ? z : x, stored);
+	free(x);
+	free(z);
 }
 
 /**
@@ -229,44 +995,330 @@ check_fail:
  * @param size 
  * @param dest 
  * @param desc 
+ * @param flags EPS_BUILD_*
  * size of `src` == size of `dest`
  */
-void eps_build(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc)
+void eps_build_ex(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc, u32 flags)
 {
-	_s("EPS\x1"); // magic
-	_s(desc); _c(0); // description
-	build_vint(buf, size); // ROM size
-	// patch data
-	const u8 *p = src, *q = dest, *of = src;
-	const u8 *end = src + size;
-	u32 on_crc = 0xFFFFFFFF, off_crc = 0xFFFFFFFF;
-	while (p < end) {
-		if (*p == *q) {
-			++p; ++q;
-			continue;
+	// diff in chunks
+	u32 num = size / DIFF_CHUNK, cpus = batch_num_cpus();
+	if (num > cpus)
+		num = cpus;
+	if (!num)
+		num = 1;
+	diff_task_t tasks[num];
+	u32 chunk = (size / num + 63) & ~63;
+	for (u32 i = 0; i < num; ++i) {
+		u32 begin = i * chunk < size ? i * chunk : size;
+		u32 end = begin + chunk < size && i + 1 < num ? begin + chunk : size;
+		tasks[i] = (diff_task_t){src, dest, begin, end, new_buf(0)};
+	}
+	pthread_t threads[num];
+	bool started[num];
+	for (u32 i = 1; i < num; ++i)
+		started[i] = !pthread_create(&threads[i], NULL, diff_main, &tasks[i]);
+	diff_main(&tasks[0]);
+	for (u32 i = 1; i < num; ++i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			diff_main(&tasks[i]);
+	}
+	// hunks touching a chunk boundary are stitched
+	buf_t *hunks = new_buf(0);
+	u32 on_crc = 0, off_crc = 0;
+	u32 h[2] = {0, 0}; // pending hunk
+	for (u32 i = 0; i < num; ++i) {
+		diff_task_t *T = &tasks[i];
+		const u32 *t = (const u32*)T->hunks->buf;
+		for (size_t j = 0; j < T->hunks->size / sizeof(u32); j += 2) {
+			if (h[1] && h[0] + h[1] == t[j]) {
+				h[1] += t[j + 1];
+				continue;
+			}
+			if (h[1])
+				buf_mcat(hunks, h, sizeof(h));
+			h[0] = t[j];
+			h[1] = t[j + 1];
 		}
-		build_vint(buf, p - of);
-		do {
-			on_crc = crc32_byte(on_crc, *q);
-			off_crc = crc32_byte(off_crc, *p);
-			_c(*p++ ^ *q++);
-		} while (p < end && *p != *q);
-		_c(0);
-		++p; ++q;
-		of = p;
-	}
-	on_crc ^= 0xFFFFFFFF;
-	off_crc ^= 0xFFFFFFFF;
-	
-	_m(&on_crc, 4); // ON CRC
-	_m(&off_crc, 4); // OFF CRC
-	u32 crc = crc32(buf->buf, buf->size);
+		on_crc = crc32_combine(on_crc, T->on_crc, T->hunk_size);
+		off_crc = crc32_combine(off_crc, T->off_crc, T->hunk_size);
+		del_buf(T->hunks);
+	}
+	if (h[1])
+		buf_mcat(hunks, h, sizeof(h));
+
+	const u32 *H = (const u32*)hunks->buf;
+	u32 num_hunks = hunks->size / sizeof(h);
+	size_t base = buf->size;
+	if (flags & (EPS_BUILD_V1 | EPS_BUILD_AUTO))
+		build_v1(buf, src, size, dest, desc, H, num_hunks, on_crc, off_crc);
+	if (!(flags & EPS_BUILD_V1)) {
+		u32 n;
+		u32 *dir = join_hunks(H, num_hunks, flags & EPS_BUILD_LZ77, &n);
+		if (flags & EPS_BUILD_COPY)
+			dir = split_copies(src, size, dest, dir, &n);
+		buf_t *v2 = new_buf(0);
+		build_v2(v2, src, size, dest, desc, dir, n, flags);
+		if (buf->size == base || v2->size < buf->size - base) { // v1 if not larger
+			buf->size = base;
+			_m(v2->buf, v2->size);
+		}
+		del_buf(v2);
+		free(dir);
+	}
+	del_buf(hunks);
+	u32 crc = crc32(0, buf->buf + base, buf->size - base);
 	_m(&crc, 4); // patch CRC
 }
 
+/* build v1 patch if it is not larger, or v2 patch with compressed payload, v3 if blocks are moved */
+void eps_build(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc)
+{
+	eps_build_ex(buf, src, size, dest, desc, EPS_BUILD_AUTO | EPS_BUILD_LZ77 | EPS_BUILD_COPY);
+}
+
 char *eps_get_desc(const u8 *patch, u32 size)
 {
-	if (!check_eps(patch, size))
+	if (!eps_version(patch, size))
 		return NULL;
 	return strdup((char*)(patch + 4));
 }
+
+
+///////////////
+// conflicts //
+///////////////
+
+eps_tree_t *eps_new_tree(void)
+{
+	return calloc(1, sizeof(eps_tree_t));
+}
+
+void eps_del_tree(eps_tree_t *T)
+{
+	if (!T)
+		return;
+	free(T->ranges);
+	free(T->max_end);
+	free(T);
+}
+
+static u32 tree_build(eps_tree_t *T, u32 lo, u32 hi)
+{
+	if (lo >= hi)
+		return 0;
+	u32 mid = lo + (hi - lo) / 2;
+	u32 m = T->ranges[mid].end;
+	u32 l = tree_build(T, lo, mid), r = tree_build(T, mid + 1, hi);
+	if (l > m)
+		m = l;
+	if (r > m)
+		m = r;
+	return T->max_end[mid] = m;
+}
+
+/* ranges of [lo, hi) overlapping [offset, end), in the order of offset */
+static void tree_find(const eps_tree_t *T, u32 lo, u32 hi, u32 offset, u32 end, buf_t *out)
+{
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (T->max_end[mid] <= offset) // nothing in subtree reaches offset
+			return;
+		tree_find(T, lo, mid, offset, end, out);
+		const eps_range_t *R = &T->ranges[mid];
+		if (R->offset >= end) // neither does anything on the right
+			return;
+		if (R->end > offset)
+			buf_mcat(out, R, sizeof(*R));
+		lo = mid + 1;
+	}
+}
+
+/**
+ * find hunks touching [offset, offset + size)
+ * @return number of hunks, `*ranges` is malloc'd and ordered by offset
+ */
+u32 eps_tree_find(const eps_tree_t *T, u32 offset, u32 size, eps_range_t **ranges)
+{
+	buf_t *out = new_buf(0);
+	tree_find(T, 0, T->num, offset, offset + size, out);
+	u32 num;
+	*ranges = buf_take(out, sizeof(eps_range_t), &num);
+	return num;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	u32 x = ((const eps_range_t*)a)->offset, y = ((const eps_range_t*)b)->offset;
+	return (x > y) - (x < y);
+}
+
+/* hunks of a patch and the bytes its copies are copied from, in the order of offset */
+static eps_range_t *patch_ranges(const eps_index_t *index, u32 patch, u32 *num)
+{
+	eps_range_t *ranges = malloc((index->num + 2 * index->copies + 1) * sizeof(*ranges));
+	u32 n = 0;
+	for (u32 i = 0; ranges && i < index->num; ++i) {
+		const eps_hunk_t *h = &index->hunks[i];
+		if (!h->size)
+			continue;
+		ranges[n++] = (eps_range_t){h->offset, h->offset + h->size, patch};
+		if (index->copies && !h->data) {
+			ranges[n++] = (eps_range_t){h->on_from, h->on_from + h->size, patch};
+			ranges[n++] = (eps_range_t){h->off_from, h->off_from + h->size, patch};
+		}
+	}
+	if (index->copies && ranges)
+		qsort(ranges, n, sizeof(*ranges), range_cmp);
+	*num = n;
+	return ranges;
+}
+
+/**
+ * add hunks of a parsed patch to the tree, and find where they overlap hunks of other patches.
+ * bytes copied by the patch are added as well: the copy goes wrong if another patch modifies them.
+ * @param patch     id of the patch, kept in its ranges
+ * @param conflicts malloc'd, `patch2` is the new patch
+ * @return number of conflicts, one for each pair of overlapping ranges
+ */
+u32 eps_tree_add(eps_tree_t *T, const eps_index_t *index, u32 patch, eps_conflict_t **conflicts)
+{
+	u32 num;
+	eps_range_t *add = patch_ranges(index, patch, &num);
+	buf_t *found = new_buf(0), *out = new_buf(0);
+	for (u32 i = 0; add && i < num; ++i) {
+		const eps_range_t *h = &add[i];
+		buf_cls(found);
+		tree_find(T, 0, T->num, h->offset, h->end, found);
+		const eps_range_t *R = (const eps_range_t*)found->buf;
+		for (u32 j = 0; j < found->size / sizeof(*R); ++j) {
+			u32 begin = R[j].offset > h->offset ? R[j].offset : h->offset;
+			u32 end = R[j].end < h->end ? R[j].end : h->end;
+			eps_conflict_t c = {R[j].patch, patch, begin, end - begin};
+			buf_mcat(out, &c, sizeof(c));
+		}
+	}
+	del_buf(found);
+
+	// merge ranges, both by offset
+	eps_range_t *ranges = malloc((T->num + num) * sizeof(*ranges));
+	u32 *max_end = malloc((T->num + num) * sizeof(*max_end));
+	if (add && ranges && max_end) {
+		u32 i = 0, j = 0, k = 0;
+		while (j < num) {
+			if (i < T->num && T->ranges[i].offset <= add[j].offset)
+				ranges[k++] = T->ranges[i++];
+			else
+				ranges[k++] = add[j++];
+		}
+		while (i < T->num)
+			ranges[k++] = T->ranges[i++];
+		free(T->ranges);
+		free(T->max_end);
+		T->ranges = ranges;
+		T->max_end = max_end;
+		T->num = k;
+		tree_build(T, 0, T->num);
+	} else {
+		free(ranges);
+		free(max_end);
+	}
+	free(add);
+	*conflicts = buf_take(out, sizeof(eps_conflict_t), &num);
+	return num;
+}
+
+/* a range being swept, with the order it is added in */
+typedef struct sweep_t {
+	eps_range_t r; // first, so sorted by `range_cmp`
+	u32 order; // 0 if already in the tree, or patch + 1
+} sweep_t;
+
+static int conflict_cmp(const void *a, const void *b)
+{
+	const eps_conflict_t *x = a, *y = b;
+	if (x->patch2 != y->patch2)
+		return (x->patch2 > y->patch2) - (x->patch2 < y->patch2);
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/**
+ * add hunks of many parsed patches, the same as `eps_tree_add` of each in turn,
+ * but all ranges are sorted and swept for overlaps once, and the tree is built once.
+ * @param indexes   the id of a patch is its position, NULL entries are skipped
+ * @param conflicts malloc'd, ordered by `patch2`, ranges already in the tree are added before
+ * @return number of conflicts
+ */
+u32 eps_tree_add_many(eps_tree_t *T, const eps_index_t *const *indexes, u32 num, eps_conflict_t **conflicts)
+{
+	buf_t *all = new_buf(0), *out = new_buf(0);
+	for (u32 i = 0; i < T->num; ++i)
+		buf_mcat(all, &(sweep_t){T->ranges[i], 0}, sizeof(sweep_t));
+	for (u32 i = 0; i < num; ++i) {
+		u32 n;
+		eps_range_t *add = indexes[i] ? patch_ranges(indexes[i], i, &n) : NULL;
+		for (u32 k = 0; add && k < n; ++k)
+			buf_mcat(all, &(sweep_t){add[k], i + 1}, sizeof(sweep_t));
+		free(add);
+	}
+	u32 total = all->size / sizeof(sweep_t);
+	sweep_t *S = (sweep_t*)all->buf;
+	qsort(S, total, sizeof(*S), range_cmp);
+
+	// a range overlaps the earlier ones still reaching its offset
+	u32 *active = malloc((total + 1) * sizeof(*active));
+	eps_range_t *ranges = malloc((total + 1) * sizeof(*ranges));
+	u32 *max_end = malloc((total + 1) * sizeof(*max_end));
+	if (active && ranges && max_end) {
+		u32 num_active = 0;
+		for (u32 i = 0; i < total; ++i) {
+			const sweep_t *h = &S[i];
+			u32 k = 0;
+			for (u32 j = 0; j < num_active; ++j) {
+				const sweep_t *R = &S[active[j]];
+				if (R->r.end <= h->r.offset) // passed
+					continue;
+				active[k++] = active[j];
+				if (R->order == h->order) // the same patch, or both in the tree
+					continue;
+				u32 end = R->r.end < h->r.end ? R->r.end : h->r.end;
+				eps_conflict_t c = R->order < h->order
+					? (eps_conflict_t){R->r.patch, h->r.patch, h->r.offset, end - h->r.offset}
+					: (eps_conflict_t){h->r.patch, R->r.patch, h->r.offset, end - h->r.offset};
+				buf_mcat(out, &c, sizeof(c));
+			}
+			active[k] = i;
+			num_active = k + 1;
+			ranges[i] = h->r;
+		}
+		free(T->ranges);
+		free(T->max_end);
+		T->ranges = ranges;
+		T->max_end = max_end;
+		T->num = total;
+		tree_build(T, 0, T->num);
+	} else {
+		free(ranges);
+		free(max_end);
+	}
+	free(active);
+	del_buf(all);
+	u32 n;
+	*conflicts = buf_take(out, sizeof(eps_conflict_t), &n);
+	if (*conflicts)
+		qsort(*conflicts, n, sizeof(**conflicts), conflict_cmp);
+	return n;
+}
+
+/* remove hunks of a patch from the tree */
+void eps_tree_remove(eps_tree_t *T, u32 patch)
+{
+	u32 k = 0;
+	for (u32 i = 0; i < T->num; ++i) {
+		if (T->ranges[i].patch != patch)
+			T->ranges[k++] = T->ranges[i];
+	}
+	T->num = k;
+	tree_build(T, 0, T->num);
+}
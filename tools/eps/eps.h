@@ -4,9 +4,70 @@
 #include "core/gba.h"
 #include "utils/buffer.h"
 
+/* flags of eps_build_ex */
+#define EPS_BUILD_V1 0x1 /* old format */
+#define EPS_BUILD_LZ77 0x2 /* v2: compress the payload if smaller */
+#define EPS_BUILD_COPY 0x4 /* v3 if blocks are moved: copy them from the ROM instead of XOR */
+#define EPS_BUILD_AUTO 0x8 /* v1 if it is not larger than v2/v3, readable by old tools */
+
+typedef struct eps_hunk_t {
+	u32 offset;
+	u32 size;
+	const u8 *data; // XOR bytes, NULL if copied
+	u32 on_crc, off_crc; // v2 only
+	u32 on_from, off_from; // v3 copy: ON bytes are at `on_from` of OFF ROM, and OFF bytes at `off_from` of ON ROM
+} eps_hunk_t;
+
+typedef struct eps_index_t {
+	char *desc;
+	u32 dst_size; // ROM size
+	u32 on_crc, off_crc;
+	u32 crc; // patch CRC, tells its content
+	u32 version; // of patch format
+	u32 copies; // number of hunks copied
+	u32 num; // number of hunks
+	eps_hunk_t hunks[];
+} eps_index_t;
+
+typedef struct eps_patch_t {
+	const eps_index_t *index; // parsed patch, or
+	const u8 *data; // patch data
+	u32 size;
+	bool check; // only check, don't apply
+	int result; // 1/0 for ON/OFF, 2 if it doesn't match the ROM, -1 if corrupted
+} eps_patch_t;
+
+typedef struct eps_range_t {
+	u32 offset, end; // [offset, end)
+	u32 patch; // id given when added
+} eps_range_t;
+
+typedef struct eps_conflict_t {
+	u32 patch1, patch2; // patch2 is added after patch1
+	u32 offset, size; // overlapping bytes
+} eps_conflict_t;
+
+/* interval tree of hunks of many patches, and the bytes their copies are copied from */
+typedef struct eps_tree_t {
+	eps_range_t *ranges; // by offset, as an implicit tree: the root of [lo, hi) is in the middle
+	u32 *max_end; // of subtree
+	u32 num;
+} eps_tree_t;
+
+eps_index_t *eps_index(const u8 *patch, u32 size);
+bool eps_apply_many(u8 **r, u32 *s, eps_patch_t *patches, u32 num);
 int eps_apply(u8 **r, u32 *s, const u8 *patch, u32 patch_size);
 int eps_check(u8 **r, u32 *s, const u8 *patch, u32 patch_size);
+int eps_check_hunk(const u8 *rom, u32 rom_size, const eps_index_t *index, u32 i);
 void eps_build(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc);
+void eps_build_ex(buf_t *buf, const u8 *src, u32 size, const u8 *dest, const char *desc, u32 flags);
 char *eps_get_desc(const u8 *patch, u32 size);
 
+eps_tree_t *eps_new_tree(void);
+void eps_del_tree(eps_tree_t *T);
+u32 eps_tree_add(eps_tree_t *T, const eps_index_t *index, u32 patch, eps_conflict_t **conflicts);
+u32 eps_tree_add_many(eps_tree_t *T, const eps_index_t *const *indexes, u32 num, eps_conflict_t **conflicts);
+void eps_tree_remove(eps_tree_t *T, u32 patch);
+u32 eps_tree_find(const eps_tree_t *T, u32 offset, u32 size, eps_range_t **ranges);
+
 #endif // _EPS_H
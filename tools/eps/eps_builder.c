@@ -10,13 +10,15 @@
 
 int main(int argc, const char *argv[])
 {
-	if (argc < 4) {
-		printf("Usage: %s <src> <dst> <patch> <description>\n", argv[0]);
+	if (argc < 5) {
+		printf("Usage: %s <src> <dst> <patch> <description> [format]\n", argv[0]);
 		puts(""
 			 "  <src>         - Source file\n"
 		     "  <dst>         - Destination file\n"
 		     "  <patch>       - Patch file\n"
-		     "  <description> - Description of the patch");
+		     "  <description> - Description of the patch\n"
+		     "  [format]      - auto (default, v1 if not larger, else v3), v3 (v2 if no block is moved), v2,\n"
+		     "                  v2raw (not compressed), or v1 for old tools");
 		return 1;
 	}
 	setlocale(LC_CTYPE, LC_UTF8);
@@ -25,6 +27,12 @@ int main(int argc, const char *argv[])
 	const char *dst_name = argv[2];
 	const char *patch_name = argv[3];
 	const char *desc = argv[4];
+	const char *format = argc > 5 ? argv[5] : "auto";
+	u32 flags = !strcmp(format, "v1") ? EPS_BUILD_V1
+		: !strcmp(format, "v2raw") ? 0
+		: !strcmp(format, "v2") ? EPS_BUILD_LZ77
+		: !strcmp(format, "v3") ? EPS_BUILD_LZ77 | EPS_BUILD_COPY
+		: EPS_BUILD_AUTO | EPS_BUILD_LZ77 | EPS_BUILD_COPY;
 
 	u8 *src, *dst, *patch;
 	u32 src_size, dst_size, patch_size;
@@ -36,7 +44,7 @@ int main(int argc, const char *argv[])
 	utf8_gbk_s(desc_utf8, desc, n);
 	// build
 	buf_t *buf = new_buf(0);
-	eps_build(buf, src, dst_size, dst, desc_utf8);
+	eps_build_ex(buf, src, dst_size, dst, desc_utf8, flags);
 	writefile(patch_name, buf->buf, buf->size);
 
 	free(src);
@@ -9,10 +9,13 @@
 
 #include <stdio.h>
 #include <locale.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "manager.h"
 #include "eps.h"
 #include "core/gba.h"
+#include "core/batch.h"
 #include "core/duckwin.h"
 #include "core/encoding.h"
 #include "utils/json.h"
@@ -27,9 +30,245 @@ static HINSTANCE Manager_hInstance;
 static HWND Manager_hDlg;
 
 static bool ROM_Modified, Config_Modified;
-static bool Enable_Patching = true, Init_Patching;
+static bool Enable_Patching = true;
 static jobj_t Config;
 
+/* parsed patches, keyed by path and modification time */
+typedef struct patch_cache_t {
+	char *name;
+	u32 size;
+	u64 mtime;
+	eps_index_t *index;
+} patch_cache_t;
+
+static patch_cache_t *Patch_Cache;
+static u32 Patch_Cache_Num;
+
+static patch_cache_t *find_patch(const char *name)
+{
+	for (u32 i = 0; i < Patch_Cache_Num; ++i) {
+		if (!strcmp(Patch_Cache[i].name, name))
+			return &Patch_Cache[i];
+	}
+	return NULL;
+}
+
+/**
+ * put the parsed patch into cache, which takes `index`
+ * @return NULL if out of memory
+ */
+static patch_cache_t *cache_patch(const char *name, u32 size, u64 mtime, eps_index_t *index)
+{
+	patch_cache_t *e = find_patch(name);
+	if (!e) {
+		patch_cache_t *cache = realloc(Patch_Cache, (Patch_Cache_Num + 1) * sizeof(*cache));
+		if (!cache) {
+			free(index);
+			return NULL;
+		}
+		Patch_Cache = cache;
+		e = &Patch_Cache[Patch_Cache_Num++];
+		e->name = strdup(name);
+	} else {
+		free(e->index);
+	}
+	e->size = size;
+	e->mtime = mtime;
+	e->index = index;
+	return e;
+}
+
+typedef struct load_task_t {
+	const char *name;
+	u32 size;
+	u64 mtime;
+	eps_index_t *index; // NULL if failed
+	bool corrupted;
+} load_task_t;
+
+/* read and parse a patch, thread safe */
+static void load_patch(load_task_t *T)
+{
+	u8 *patch;
+	u32 size;
+	T->index = NULL;
+	T->corrupted = false;
+	if (!filestat(T->name, &T->size, &T->mtime) || !readfile(T->name, &patch, &size))
+		return;
+	T->index = eps_index(patch, size);
+	T->corrupted = !T->index;
+	free(patch);
+}
+
+typedef struct loader_t {
+	load_task_t *tasks;
+	u32 num;
+	atomic_uint next;
+} loader_t;
+
+static void *loader_main(void *arg)
+{
+	loader_t *L = arg;
+	for (u32 i; (i = atomic_fetch_add(&L->next, 1)) < L->num; )
+		load_patch(&L->tasks[i]);
+	return NULL;
+}
+
+/* load patches on all cores */
+static void load_patches(load_task_t *tasks, u32 num)
+{
+	loader_t L = {tasks, num};
+	u32 n = batch_num_cpus();
+	if (n > num)
+		n = num;
+	if (n < 2) {
+		loader_main(&L);
+		return;
+	}
+	pthread_t threads[n - 1];
+	u32 started = 0;
+	while (started < n - 1 && !pthread_create(&threads[started], NULL, loader_main, &L))
+		++started;
+	loader_main(&L);
+	for (u32 i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+/**
+ * get the parsed patch, the file is read again only if it has been modified
+ * @return NULL if it can't be read, or is corrupted (`*corrupted` is true)
+ */
+static const patch_cache_t *get_patch(const char *name, bool *corrupted)
+{
+	*corrupted = false;
+	u32 size;
+	u64 mtime;
+	if (!filestat(name, &size, &mtime))
+		return NULL;
+	patch_cache_t *e = find_patch(name);
+	if (e && e->size == size && e->mtime == mtime)
+		return e;
+	load_task_t T = {name};
+	load_patch(&T);
+	*corrupted = T.corrupted;
+	return T.index ? cache_patch(name, T.size, T.mtime, T.index) : NULL;
+}
+
+static void drop_patch(const char *name)
+{
+	patch_cache_t *e = find_patch(name);
+	if (e) {
+		free(e->name);
+		free(e->index);
+		*e = Patch_Cache[--Patch_Cache_Num];
+	}
+}
+
+/**
+ * config entry of a patch: {"on": bool, "size": int, "mtime": int, "crc": int, "desc": str}
+ * size, mtime and crc (patch CRC) tell if the patch file is unchanged,
+ * then it is listed by the entry without being read.
+ * in old configs, the entry is only a bool of "on".
+ */
+static bool patch_on(jitem_t item)
+{
+	if (item->t == JT_BOOL)
+		return item->b;
+	jitem_t on = item->t == JT_OBJECT ? json_get(item->o, "on") : NULL;
+	return on && on->t == JT_BOOL && on->b;
+}
+
+static jlong_t patch_info(jitem_t item, const char *key)
+{
+	jitem_t v = item->t == JT_OBJECT ? json_get(item->o, key) : NULL;
+	return v && v->t == JT_LONG ? v->l : -1;
+}
+
+static void set_patch(const char *name, bool on, const patch_cache_t *e)
+{
+	jobj_t o = json_load("{}");
+	json_add(o, "on", &(struct _jsonval){.t = JT_BOOL, .b = on});
+	json_add(o, "size", &(struct _jsonval){.t = JT_LONG, .l = e->size});
+	json_add(o, "mtime", &(struct _jsonval){.t = JT_LONG, .l = e->mtime});
+	json_add(o, "crc", &(struct _jsonval){.t = JT_LONG, .l = e->index->crc});
+	size_t n = strlen(e->index->desc) + 1;
+	wchar_t *desc = malloc(n * sizeof(wchar_t));
+	utf16_utf8_s((u16*)desc, e->index->desc, n);
+	json_add(o, "desc", &(struct _jsonval){.t = JT_STRING, .s = desc});
+	free(desc);
+	json_add(Config, name, &(struct _jsonval){.t = JT_OBJECT, .o = o});
+	json_free(o);
+	Config_Modified = true;
+}
+
+static int apply_patch(const eps_index_t *index, bool check)
+{
+	eps_patch_t P = {.index = index, .check = check};
+	eps_apply_many(&ROM, &ROM_size, &P, 1);
+	return P.result;
+}
+
+/**
+ * 检查补丁之间的冲突 (修改了相同的字节), 有冲突则弹窗说明
+ * @param from 只报告 names[from] 及之后的补丁与之前补丁的冲突
+ * @return 是否有冲突
+ */
+static bool report_conflicts(const char **names, u32 num, u32 from)
+{
+	eps_tree_t *T = eps_new_tree();
+	const eps_index_t **indexes = calloc(num, sizeof(*indexes));
+	u32 *count = calloc(num, sizeof(*count)); // 与每个补丁重叠的块数
+	u32 *first = calloc(num, sizeof(*first)); // 第一处重叠的地址
+	buf_t *msg = new_buf(0);
+	if (!T || !indexes || !count || !first)
+		goto clean;
+	for (u32 i = 0; i < num; ++i) {
+		bool corrupted;
+		const patch_cache_t *e = get_patch(names[i], &corrupted);
+		indexes[i] = e ? e->index : NULL; // 无法读取或补丁损坏, 不参与检查
+	}
+	// 一次加入所有补丁, 冲突按后加入的补丁排列
+	eps_conflict_t *C;
+	u32 n = eps_tree_add_many(T, indexes, num, &C);
+	for (u32 k = 0, end; k < n; k = end) {
+		u32 i = C[k].patch2;
+		for (end = k; end < n && C[end].patch2 == i; ++end);
+		if (i < from)
+			continue;
+		memset(count, 0, i * sizeof(*count));
+		for (; k < end; ++k) {
+			u32 j = C[k].patch1;
+			if (!count[j]++ || C[k].offset < first[j])
+				first[j] = C[k].offset;
+		}
+		for (u32 j = 0; j < i; ++j) {
+			if (!count[j])
+				continue;
+			wchar_t w1[MAX_PATH], w2[MAX_PATH];
+			mbstowcs(w1, names[j], lenof(w1));
+			mbstowcs(w2, names[i], lenof(w2));
+			buf_wcatf(msg, L"%ls\n%ls\n%u 处重叠, 起始于 0x%06X\n\n", w1, w2, count[j], first[j]);
+		}
+	}
+	free(C);
+	if (msg->size) {
+		buf_wccat(msg, 0);
+		size_t n = msg->size;
+		TCHAR *tmsg = malloc(n * sizeof(TCHAR));
+		wcstotcs(tmsg, (const wchar_t*)msg->buf, n);
+		MessageBox(Manager_hDlg, tmsg, TEXT("补丁冲突"), MB_OK | MB_ICONWARNING);
+		free(tmsg);
+	}
+clean:
+	bool found = msg->size;
+	eps_del_tree(T);
+	free(indexes);
+	free(count);
+	free(first);
+	del_buf(msg);
+	return found;
+}
+
 static void manager_lvw_init(HWND hLvw)
 {
 	LVCOLUMN lvc = {
@@ -59,6 +298,37 @@ static int lvw_addItem(HWND hLvw, LPTSTR patch, LPTSTR desc)
 	return index;
 }
 
+/* 报告补丁与已应用补丁的冲突 */
+static bool conflict_with_on(const char *name)
+{
+	const char **names = malloc((json_count(Config) + 1) * sizeof(*names));
+	if (!names)
+		return false;
+	u32 n = 0;
+	JSON_FOR_OBJ(Config, item) {
+		if (patch_on(item) && strcmp(item->key, name))
+			names[n++] = item->key;
+	}
+	names[n++] = name;
+	bool found = report_conflicts(names, n, n - 1);
+	free(names);
+	return found;
+}
+
+/* 报告列表中所有补丁之间的冲突 */
+static void check_conflicts(void)
+{
+	const char **names = malloc((json_count(Config) + 1) * sizeof(*names));
+	if (!names)
+		return;
+	u32 n = 0;
+	JSON_FOR_OBJ(Config, item)
+		names[n++] = item->key;
+	if (!report_conflicts(names, n, 0))
+		MessageBox(Manager_hDlg, TEXT("没有冲突"), TEXT("检查冲突"), MB_OK | MB_ICONINFORMATION);
+	free(names);
+}
+
 static void lvw_onChange(HWND hLvw, int index)
 {
 	if (!Enable_Patching)
@@ -68,29 +338,32 @@ static void lvw_onChange(HWND hLvw, int index)
 	char mbuf[MAX_PATH];
 	tcstombs(mbuf, tbuf, lenof(mbuf), CP_UTF8);
 
-	u8 *patch;
-	u32 size;
-	if (!readfile(mbuf, &patch, &size)) {
+	bool corrupted;
+	const patch_cache_t *patch = get_patch(mbuf, &corrupted);
+	if (!patch && !corrupted) {
 		MessageBox(NULL, TEXT("无法打开补丁文件"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
 		return;
 	}
-	jitem_t item = json_get(Config, mbuf);
-	u32 result = eps_apply(&ROM, &ROM_size, patch, size);
+	int result = patch ? apply_patch(patch->index, true) : -1; // 先检查, 失败时无需清除修改
 	if (result == 0 || result == 1) {
-		item->b = result;
-		ROM_Modified = true;
-		Config_Modified = true;
+		result = apply_patch(patch->index, false); // 应用后的状态
+		if (result == 0 || result == 1) {
+			set_patch(mbuf, result, patch);
+			ROM_Modified = true;
+			return;
+		}
+		MessageBox(NULL, TEXT("无法应用补丁"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
+		apply_patch(patch->index, false); // 清除修改
+		ListView_SetCheckState(hLvw, index, FALSE);
 	} else {
 		if (result == -1) {
 			MessageBox(NULL, TEXT("补丁损坏"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
 		}
-		if (result == 2) {
+		if (result == 2 && !conflict_with_on(mbuf)) {
 			MessageBox(NULL, TEXT("无法应用补丁"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
-			eps_apply(&ROM, &ROM_size, patch, size); // 清除修改
 		}
 		ListView_SetCheckState(hLvw, index, FALSE);
 	}
-	free(patch);
 }
 
 static wchar_t *manager_open_ROM(void)
@@ -106,7 +379,7 @@ static bool manager_load_ROM(const wchar_t *name)
 {
 	char buf[MAX_PATH];
 	wcstombs(buf, name, lenof(buf));
-	if (!load_ROM(buf))
+	if (!map_ROM(buf)) // only modified pages are written back
 		return false;
 	return true;
 }
@@ -134,50 +407,53 @@ static wchar_t *manager_open_patch(void)
 	return DwOpenFileDialog(Manager_hDlg, cf, lenof(cf));
 }
 
-static void add_patch(HWND hLvw, wchar_t *name, int checked)
+static void list_patch(HWND hLvw, jitem_t item)
 {
-	// 补丁名
-	char mbuf[MAX_PATH];
+	wchar_t wbuf[MAX_PATH];
 	TCHAR tbuf[MAX_PATH];
-	wcstombs(mbuf, name, lenof(mbuf));
-	wcstotcs(tbuf, name, lenof(tbuf));
-
-	// 打开补丁
-	u8 *patch;
-	u32 size;
-	readfile(mbuf, &patch, &size);
-
-	if (!Init_Patching) {
-		if (Config && json_get(Config, mbuf)) // 已存在该补丁
-			return;
-		checked = eps_check(&ROM, &ROM_size, patch, size);
-		if (checked != 0 && checked != 1) {
-			if (checked == -1)
-				MessageBox(Manager_hDlg, TEXT("补丁损坏"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
-			if (checked == 2)
-				MessageBox(Manager_hDlg, TEXT("无法应用补丁"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
-			free(patch);
-			return;
-		}
-		json_add(Config, mbuf, &(struct _jsonval){.t = JT_BOOL, .b = checked}); // 添加补丁到配置
-	}
+	mbstowcs(wbuf, item->key, lenof(wbuf));
+	wcstotcs(tbuf, wbuf, lenof(tbuf));
 	// 补丁描述
-	char *mdesc = eps_get_desc(patch, size);
-	free(patch);
+	jitem_t desc = item->t == JT_OBJECT ? json_get(item->o, "desc") : NULL;
+	const wchar_t *wdesc = desc && desc->t == JT_STRING ? desc->s : L"";
 
-	size_t n = strlen(mdesc) + 1;
+	size_t n = (wcslen(wdesc) + 1) * 2;
 	TCHAR *tdesc = malloc(n * sizeof(TCHAR));
-	mbstotcs(tdesc, mdesc, n, CP_UTF8);
-	free(mdesc);
+	wcstotcs(tdesc, wdesc, n);
 	// 添加到列表
 	Enable_Patching = false; // 防止刷新列表时触发应用补丁
 	int index = lvw_addItem(hLvw, tbuf, tdesc);
 	free(tdesc);
-	ListView_SetCheckState(hLvw, index, checked);
+	ListView_SetCheckState(hLvw, index, patch_on(item));
 	Enable_Patching = true;
+}
 
-	Config_Modified = true;
-not_available:
+static void add_patch(HWND hLvw, wchar_t *name)
+{
+	// 补丁名
+	char mbuf[MAX_PATH];
+	wcstombs(mbuf, name, lenof(mbuf));
+	if (Config && json_get(Config, mbuf)) // 已存在该补丁
+		return;
+
+	// 打开补丁
+	bool corrupted;
+	const patch_cache_t *patch = get_patch(mbuf, &corrupted);
+	if (!patch && !corrupted) {
+		MessageBox(Manager_hDlg, TEXT("无法打开补丁文件"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
+		return;
+	}
+
+	int checked = patch ? apply_patch(patch->index, true) : -1;
+	if (checked != 0 && checked != 1) {
+		if (checked == -1)
+			MessageBox(Manager_hDlg, TEXT("补丁损坏"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
+		if (checked == 2)
+			MessageBox(Manager_hDlg, TEXT("无法应用补丁"), TEXT("操作失败"), MB_OK | MB_ICONERROR);
+		return;
+	}
+	set_patch(mbuf, checked, patch); // 添加补丁到配置
+	list_patch(hLvw, json_get(Config, mbuf));
 }
 
 static void del_patch(HWND hLvw, int index)
@@ -188,6 +464,7 @@ static void del_patch(HWND hLvw, int index)
 	char mbuf[MAX_PATH];
 	tcstombs(mbuf, tbuf, lenof(mbuf), CP_UTF8);
 	json_rmv(Config, mbuf);
+	drop_patch(mbuf);
 	Config_Modified = true;
 }
 
@@ -195,13 +472,44 @@ static void init_eps_list(HWND hLvw)
 {
 	if (!Config)
 		return;
-	wchar_t wbuf[MAX_PATH];
-	Init_Patching = true;
+	// 只读取新的或修改过的补丁
+	u32 num = json_count(Config), n = 0;
+	load_task_t *tasks = calloc(num + 1, sizeof(*tasks));
+	eps_patch_t *patches = calloc(num + 1, sizeof(*patches));
+	if (!tasks || !patches)
+		goto clean;
 	JSON_FOR_OBJ(Config, item) {
-		mbstowcs(wbuf, item->key, lenof(wbuf));
-		add_patch(hLvw, wbuf, item->b);
+		u32 size;
+		u64 mtime;
+		if (filestat(item->key, &size, &mtime) && size == patch_info(item, "size") && mtime == patch_info(item, "mtime"))
+			continue;
+		tasks[n++].name = item->key;
 	}
-	Init_Patching = false;
+	load_patches(tasks, n);
+
+	// 内容改变的补丁, 一次检查
+	for (u32 i = 0; i < n; ++i) {
+		patches[i].check = true;
+		if (tasks[i].index && tasks[i].index->crc != patch_info(json_get(Config, tasks[i].name), "crc"))
+			patches[i].index = tasks[i].index;
+	}
+	eps_apply_many(&ROM, &ROM_size, patches, n);
+	for (u32 i = 0; i < n; ++i) {
+		load_task_t *T = &tasks[i];
+		if (!T->index) // 无法读取或补丁损坏, 保留原状态
+			continue;
+		int result = patches[i].result;
+		bool on = result == 0 || result == 1 ? result : patch_on(json_get(Config, T->name));
+		const patch_cache_t *e = cache_patch(T->name, T->size, T->mtime, T->index);
+		if (e)
+			set_patch(T->name, on, e);
+	}
+
+	JSON_FOR_OBJ(Config, item)
+		list_patch(hLvw, item);
+clean:
+	free(tasks);
+	free(patches);
 }
 
 static void manager_open_config(HWND hList, char *config_name, const char *rom_name)
@@ -279,7 +587,7 @@ INT_PTR CALLBACK dlgproc_manager(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lPa
 					manager_load_ROM(wbuf);
 					manager_open_config(hlvwEps, Config_Name, ROM_Name);
 				} else {
-					add_patch(hlvwEps, wbuf, false);
+					add_patch(hlvwEps, wbuf);
 				}
 			}
 			DragFinish(hDrop);
@@ -304,7 +612,7 @@ INT_PTR CALLBACK dlgproc_manager(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lPa
 				}
 				case IDI_ADD_PATCH: {
 					wchar_t *name = manager_open_patch();
-					add_patch(hlvwEps, name, false);
+					add_patch(hlvwEps, name);
 					free(name);
 					break;
 				}
@@ -314,6 +622,10 @@ INT_PTR CALLBACK dlgproc_manager(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lPa
 						del_patch(hlvwEps, index);
 					break;
 				}
+				case IDI_CHECK_CONFLICTS: {
+					check_conflicts();
+					break;
+				}
 			}
 			return TRUE;
 		}
@@ -10,6 +10,7 @@
 #define IDI_FILE_SAVE 10001
 #define IDI_ADD_PATCH 10002
 #define IDI_DEL_PATCH 10003
+#define IDI_CHECK_CONFLICTS 10004
 #define IDC_STATIC -1
 #define IDC_LVWEPS 1000
 
@@ -0,0 +1,223 @@
+/**
+ * batch recompression
+ * usage: recomp <manifest> [-j <threads>] [-o <stats>]
+ *
+ * manifest (JSON):
+ * {
+ *   "rom": "sangokushi.gba",                                  // needed by ROM pointers
+ *   "jobs": [
+ *     {"src": "0x8123456", "codec": "lz77", "out": "a.bin"},  // BIOS stream in ROM
+ *     {"src": "0x8234567", "source": "koei", "codec": "auto"},
+ *     {"src": "0x8345678", "source": "raw", "size": 4096, "codec": "rl"},
+ *     {"src": "font.bin", "codec": "huff4", "effort": 0}      // raw file
+ *   ]
+ * }
+ * source: raw, bios, koei (default: bios for ROM pointer, raw for file)
+ * size: bytes of raw data, needed by raw source at ROM pointer
+ * codec: bare, rl, lz77, lz77lazy, lz77opt, huff4, huff8, koei, auto
+ * effort: LZ77 effort, KOEI_LZ77_* for koei, KOEI_COMP_* flags for auto
+ * out: default is <src>.bin
+ *
+ * stats are written as JSON to <stats> or stdout.
+ */
+
+#include "core/batch.h"
+#include "core/encoding.h"
+#include "core/koei.h"
+#include "utils/io.h"
+#include "utils/json.h"
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+	const char *name;
+	BatchCodec codec;
+	u32 effort; // default
+} Codecs[] = {
+	{"bare", BatchCodecBare, 0},
+	{"rl", BatchCodecRL, 0},
+	{"lz77", BatchCodecLZ77, LZ77_EFFORT_DEFAULT},
+	{"lz77lazy", BatchCodecLZ77Lazy, LZ77_EFFORT_DEFAULT},
+	{"lz77opt", BatchCodecLZ77Opt, LZ77_EFFORT_DEFAULT},
+	{"huff4", BatchCodecHuff4, 0},
+	{"huff8", BatchCodecHuff8, 0},
+	{"koei", BatchCodecKoeiLZ77, KOEI_LZ77_GREEDY},
+	{"auto", BatchCodecAuto, KOEI_COMP_FILTER},
+};
+
+static const char *Sources[] = {"raw", "bios", "koei"};
+
+typedef struct task_t {
+	char src[FILENAME_MAX];
+	char out[FILENAME_MAX];
+	u8 *file; // raw file, NULL for ROM pointer
+	u32 codec; // index of Codecs
+} task_t;
+
+static bool get_str(jobj_t obj, const char *key, char *buf, u32 size)
+{
+	jitem_t item = json_get(obj, key);
+	if (!item || item->t != JT_STRING)
+		return false;
+	wcstombs(buf, item->s, size);
+	buf[size - 1] = '\0';
+	return true;
+}
+
+static bool parse_job(jobj_t obj, task_t *T, batch_job_t *J)
+{
+	char buf[16];
+	if (!get_str(obj, "src", T->src, sizeof(T->src)))
+		return false;
+	// codec
+	if (!get_str(obj, "codec", buf, sizeof(buf)))
+		return false;
+	for (T->codec = 0; T->codec < lenof(Codecs) && strcmp(buf, Codecs[T->codec].name); ++T->codec);
+	if (T->codec == lenof(Codecs))
+		return false;
+	J->codec = Codecs[T->codec].codec;
+	jitem_t item = json_get(obj, "effort");
+	J->effort = item && item->t == JT_LONG ? item->l : Codecs[T->codec].effort;
+	// source
+	char *end;
+	u32 P = strtoul(T->src, &end, 16);
+	if (!*end && ROM && check_ROM_pointer(P)) {
+		J->source = BatchSourceBIOS;
+		J->src = R2p(P);
+		J->src_avail = ROM + ROM_size - J->src;
+	} else {
+		J->source = BatchSourceRaw;
+		if (!readfile(T->src, &T->file, &J->src_size))
+			return false;
+		J->src = T->file;
+		J->src_avail = J->src_size;
+	}
+	if (get_str(obj, "source", buf, sizeof(buf))) {
+		u32 i = 0;
+		for (; i < lenof(Sources) && strcmp(buf, Sources[i]); ++i);
+		if (i == lenof(Sources))
+			return false;
+		J->source = i;
+	}
+	if (J->source == BatchSourceRaw && !T->file) { // nothing tells the size in ROM
+		item = json_get(obj, "size");
+		if (!item || item->t != JT_LONG || item->l <= 0 || item->l > J->src_avail)
+			return false;
+		J->src_size = item->l;
+	}
+	if (J->source == BatchSourceBIOS)
+		J->src_size = J->src_avail >= 4 ? *(u32*)J->src >> 8 : 0;
+	if (!get_str(obj, "out", T->out, sizeof(T->out)))
+		snprintf(T->out, sizeof(T->out), "%s.bin", T->src);
+	return true;
+}
+
+static void add_val(jobj_t obj, const char *key, struct _jsonval val)
+{
+	json_add(obj, key, &val);
+}
+
+static jstr_t to_wcs(const char *s)
+{
+	static wchar_t buf[FILENAME_MAX];
+	mbstowcs(buf, s, lenof(buf));
+	buf[lenof(buf) - 1] = L'\0';
+	return buf;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc < 2) {
+		printf("Usage: %s <manifest> [-j <threads>] [-o <stats>]\n", argv[0]);
+		return 1;
+	}
+	setlocale(LC_CTYPE, LC_UTF8);
+
+	const char *stats_name = NULL;
+	u32 num_threads = 0;
+	for (int i = 2; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "-j"))
+			num_threads = strtoul(argv[i + 1], NULL, 0);
+		else if (!strcmp(argv[i], "-o"))
+			stats_name = argv[i + 1];
+	}
+	jobj_t manifest = json_loadf(argv[1]);
+	if (!manifest) {
+		fprintf(stderr, "cannot load %s\n", argv[1]);
+		return 1;
+	}
+	char rom_name[FILENAME_MAX];
+	if (get_str(manifest, "rom", rom_name, sizeof(rom_name)) && !load_ROM(rom_name)) {
+		fprintf(stderr, "cannot load %s\n", rom_name);
+		return 1;
+	}
+	jitem_t item = json_get(manifest, "jobs");
+	jarr_t arr = item && item->t == JT_ARRAY ? item->a : NULL;
+	u32 n = arr ? json_count(arr) : 0;
+	task_t *tasks = allocz(n + 1, tasks);
+	batch_job_t *jobs = allocz(n + 1, jobs);
+	for (u32 i = 0; i < n; ++i) {
+		if (arr->data[i].t != JT_OBJECT || !parse_job(arr->data[i].o, &tasks[i], &jobs[i])) {
+			fprintf(stderr, "invalid job %u\n", i);
+			return 1;
+		}
+	}
+
+	batch_stats_t stats;
+	if (batch_run(jobs, n, num_threads, &stats)) {
+		fputs("out of memory\n", stderr);
+		return 1;
+	}
+
+	jobj_t root = json_load("{}");
+	jarr_t results = json_load("[]");
+	for (u32 i = 0; i < n; ++i) {
+		task_t *T = &tasks[i];
+		batch_job_t *J = &jobs[i];
+		if (J->dest)
+			writefile(T->out, J->dest, J->dest_size);
+		else
+			fprintf(stderr, "job %u (%s) failed\n", i, T->src);
+		jobj_t r = json_load("{}");
+		add_val(r, "src", (struct _jsonval){.t = JT_STRING, .s = to_wcs(T->src)});
+		add_val(r, "out", (struct _jsonval){.t = JT_STRING, .s = to_wcs(T->out)});
+		add_val(r, "codec", (struct _jsonval){.t = JT_STRING, .s = to_wcs(Codecs[T->codec].name)});
+		add_val(r, "ok", (struct _jsonval){.t = JT_BOOL, .b = J->dest != NULL});
+		add_val(r, "raw_size", (struct _jsonval){.t = JT_LONG, .l = J->raw_size});
+		add_val(r, "size", (struct _jsonval){.t = JT_LONG, .l = J->dest ? (jlong_t)J->dest_size : -1});
+		add_val(r, "time", (struct _jsonval){.t = JT_REAL, .r = J->time});
+		add_val(r, "thread", (struct _jsonval){.t = JT_LONG, .l = J->thread});
+		json_add(results, &(struct _jsonval){.t = JT_OBJECT, .o = r});
+		json_free(r);
+		free(J->dest);
+		free(T->file);
+	}
+	add_val(root, "threads", (struct _jsonval){.t = JT_LONG, .l = stats.threads});
+	add_val(root, "jobs", (struct _jsonval){.t = JT_LONG, .l = stats.done});
+	add_val(root, "failed", (struct _jsonval){.t = JT_LONG, .l = stats.failed});
+	add_val(root, "raw_size", (struct _jsonval){.t = JT_LONG, .l = stats.raw_size});
+	add_val(root, "size", (struct _jsonval){.t = JT_LONG, .l = stats.dest_size});
+	add_val(root, "time", (struct _jsonval){.t = JT_REAL, .r = stats.time});
+	add_val(root, "job_time", (struct _jsonval){.t = JT_REAL, .r = stats.job_time});
+	add_val(root, "steals", (struct _jsonval){.t = JT_LONG, .l = stats.steals});
+	add_val(root, "results", (struct _jsonval){.t = JT_ARRAY, .a = results});
+	json_free(results);
+
+	char *s = json_save(root, true);
+	FILE *fp = stats_name ? fopen(stats_name, "w") : stdout;
+	if (fp) {
+		fputs(s, fp);
+		fputc('\n', fp);
+		if (fp != stdout)
+			fclose(fp);
+	}
+	free(s);
+	json_free(root);
+	json_free(manifest);
+	free(tasks);
+	free(jobs);
+	free_ROM();
+	return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * index BIOS compressed streams of ROM
+ * usage: romscan <ROM> [-a] [-j <threads>] [-min <size>] [-max <size>] [-o <index>]
+ *
+ * index is JSON, an array of {"offset", "type", "packed_size", "size", "valid"},
+ * offset is ROM address. only valid streams are listed unless -a is given.
+ */
+
+#include "core/scan.h"
+#include "utils/json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void add_val(jobj_t obj, const char *key, struct _jsonval val)
+{
+	json_add(obj, key, &val);
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc < 2) {
+		printf("Usage: %s <ROM> [-a] [-j <threads>] [-min <size>] [-max <size>] [-o <index>]\n", argv[0]);
+		return 1;
+	}
+	bool all = false;
+	u32 num_threads = 0, min_size = SCAN_MIN_SIZE, max_size = SCAN_MAX_SIZE;
+	const char *out_name = NULL;
+	for (int i = 2; i < argc; ++i) {
+		if (!strcmp(argv[i], "-a"))
+			all = true;
+		else if (i + 1 >= argc)
+			break;
+		else if (!strcmp(argv[i], "-j"))
+			num_threads = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-min"))
+			min_size = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-max"))
+			max_size = strtoul(argv[++i], NULL, 0);
+		else if (!strcmp(argv[i], "-o"))
+			out_name = argv[++i];
+	}
+	if (!load_ROM(argv[1])) {
+		fprintf(stderr, "cannot load %s\n", argv[1]);
+		return 1;
+	}
+
+	clock_t t = clock();
+	scan_entry_t *E;
+	u32 n = scan_ROM(ROM, ROM_size, min_size, max_size, num_threads, &E);
+	fprintf(stderr, "%u candidates in %.3fs\n", n, (double)(clock() - t) / CLOCKS_PER_SEC);
+
+	jarr_t index = json_load("[]");
+	u32 valid = 0;
+	for (u32 i = 0; i < n; ++i) {
+		valid += E[i].valid;
+		if (!all && !E[i].valid)
+			continue;
+		jobj_t e = json_load("{}");
+		add_val(e, "offset", (struct _jsonval){.t = JT_LONG, .l = E[i].offset + ROM_BASE});
+		add_val(e, "type", (struct _jsonval){.t = JT_LONG, .l = E[i].type});
+		add_val(e, "packed_size", (struct _jsonval){.t = JT_LONG, .l = E[i].packed_size});
+		add_val(e, "size", (struct _jsonval){.t = JT_LONG, .l = E[i].size});
+		add_val(e, "valid", (struct _jsonval){.t = JT_BOOL, .b = E[i].valid});
+		json_add(index, &(struct _jsonval){.t = JT_OBJECT, .o = e});
+		json_free(e);
+	}
+	fprintf(stderr, "%u valid\n", valid);
+
+	char *s = json_save(index, true);
+	FILE *fp = out_name ? fopen(out_name, "w") : stdout;
+	if (fp) {
+		fputs(s, fp);
+		fputc('\n', fp);
+		if (fp != stdout)
+			fclose(fp);
+	}
+	free(s);
+	json_free(index);
+	free(E);
+	free_ROM();
+	return 0;
+}
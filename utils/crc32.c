@@ -0,0 +1,156 @@
+#include <string.h>
+#include "crc32.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_CLMUL
+#include <immintrin.h>
+#endif
+
+/**
+ * slicing-by-8: 8 bytes per step with 8 tables, the table k gives CRC of a byte followed by k zeros.
+ * with PCLMULQDQ (checked at startup), 64-byte blocks are folded by carry-less multiplication
+ * ("Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel).
+ */
+
+#define POLY 0xEDB88320
+
+static uint32_t Table[8][256];
+#ifdef CRC32_CLMUL
+static bool Has_CLMUL;
+#endif
+
+__attribute__((constructor)) static void crc32_init(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+		Table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; ++i)
+		for (int k = 1; k < 8; ++k)
+			Table[k][i] = (Table[k - 1][i] >> 8) ^ Table[0][Table[k - 1][i] & 0xFF];
+#ifdef CRC32_CLMUL
+	__builtin_cpu_init();
+	Has_CLMUL = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+/* `crc` is inverted */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	for (; size && ((uintptr_t)p & 7); --size)
+		crc = Table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	for (; size >= 8; size -= 8, p += 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = Table[7][lo & 0xFF] ^ Table[6][lo >> 8 & 0xFF] ^ Table[5][lo >> 16 & 0xFF] ^ Table[4][lo >> 24]
+			^ Table[3][hi & 0xFF] ^ Table[2][hi >> 8 & 0xFF] ^ Table[1][hi >> 16 & 0xFF] ^ Table[0][hi >> 24];
+	}
+	for (; size; --size)
+		crc = Table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32_CLMUL
+/* `crc` is inverted, `size` >= 64 and a multiple of 16 */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	// x^(4*128+64), x^(4*128), x^(128+64), x^128, x^64 mod P, and P, floor(x^64 / P), bit reflected
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	size -= 64;
+	// fold 4 blocks in parallel
+	for (; size >= 64; size -= 64, p += 64) {
+		__m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+	}
+	// fold into 128 bits
+	__m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+	for (; size >= 16; size -= 16, p += 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p)), x5);
+	}
+	// 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+	// Barrett reduction to 32 bits
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t crc32(uint32_t crc, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	crc = ~crc;
+#ifdef CRC32_CLMUL
+	if (Has_CLMUL && size >= 64) {
+		size_t n = size & ~(size_t)15;
+		crc = crc32_clmul(crc, p, n);
+		p += n;
+		size -= n;
+	}
+#endif
+	return ~crc32_slice8(crc, p, size);
+}
+
+/* a * b mod P, polynomials are bit reflected: x^0 is the MSB */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t p = 0;
+	for (uint32_t m = 1u << 31; m; m >>= 1) {
+		if (a & m)
+			p ^= b;
+		b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+	}
+	return p;
+}
+
+/**
+ * appending n zero bytes to A multiplies its CRC register by x^(8n) mod P,
+ * x^(8n) is made of the squares x^8, x^16, x^32, ...
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2)
+{
+	uint32_t p = 1u << 31, x = 1u << 23; // x^0, x^8
+	for (; size2; size2 >>= 1, x = multmodp(x, x)) {
+		if (size2 & 1)
+			p = multmodp(x, p);
+	}
+	return multmodp(p, crc1) ^ crc2;
+}
@@ -0,0 +1,12 @@
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (zlib): start with 0, continue with the previous result */
+uint32_t crc32(uint32_t crc, const void *data, size_t size);
+/* CRC of A followed by B, from the CRCs of A and B */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t size2);
+
+#endif // _CRC32_H
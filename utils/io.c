@@ -1,6 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "io.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /**
  * read a binary file to buffer
@@ -42,3 +50,109 @@ void writefile(const char *name, u8 *buf, u32 size)
 	fwrite(buf, 1, size, fp);
 	fclose(fp);
 }
+
+/**
+ * get the size and last modification time of a file, without opening it
+ * @param  name  filename
+ * @param  size  size of file
+ * @param  mtime modification time, in an unspecified unit
+ * @return       true if succeeded, false if failed
+ */
+bool filestat(const char *name, u32 *size, u64 *mtime)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!GetFileAttributesExA(name, GetFileExInfoStandard, &fad))
+		return false;
+	*size = fad.nFileSizeLow;
+	*mtime = (u64)fad.ftLastWriteTime.dwHighDateTime << 32 | fad.ftLastWriteTime.dwLowDateTime;
+	return true;
+#else
+	struct stat st;
+	if (stat(name, &st))
+		return false;
+	*size = st.st_size;
+	*mtime = (u64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	return true;
+#endif
+}
+
+/**
+ * get the identity of a file, equal for all names (paths, links) of the same file
+ * @param  name filename
+ * @param  id   volume and index of file
+ * @return      true if succeeded, false if failed
+ */
+bool fileid(const char *name, u64 id[2])
+{
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(name, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	BY_HANDLE_FILE_INFORMATION fi;
+	bool r = GetFileInformationByHandle(hFile, &fi);
+	CloseHandle(hFile);
+	id[0] = fi.dwVolumeSerialNumber;
+	id[1] = (u64)fi.nFileIndexHigh << 32 | fi.nFileIndexLow;
+	return r;
+#else
+	struct stat st;
+	if (stat(name, &st))
+		return false;
+	id[0] = st.st_dev;
+	id[1] = st.st_ino;
+	return true;
+#endif
+}
+
+/**
+ * map a file into memory, copy-on-write: the file is never modified through the mapping
+ * @param  name filename
+ * @param  buf  pointer to mapping
+ * @param  size size of file
+ * @return      true if succeeded, false if failed (or file is empty)
+ */
+bool mapfile(const char *name, u8 **buf, u32 *size)
+{
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	*size = GetFileSize(hFile, NULL);
+	HANDLE hMap = *size ? CreateFileMappingA(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+	*buf = hMap ? MapViewOfFile(hMap, FILE_MAP_COPY, 0, 0, 0) : NULL;
+	// the view keeps the file open
+	if (hMap)
+		CloseHandle(hMap);
+	CloseHandle(hFile);
+	return *buf != NULL;
+#else
+	int fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	*buf = NULL;
+	if (!fstat(fd, &st) && st.st_size > 0) {
+		*size = st.st_size;
+		void *p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED)
+			*buf = p;
+	}
+	close(fd);
+	return *buf != NULL;
+#endif
+}
+
+/**
+ * unmap a file mapped by `mapfile`, modifications are discarded
+ */
+void unmapfile(u8 *buf, u32 size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(buf);
+#else
+	munmap(buf, size);
+#endif
+}
@@ -5,5 +5,9 @@
 
 bool readfile(const char *name, u8 **buf, u32 *size);
 void writefile(const char *name, u8 *buf, u32 size);
+bool filestat(const char *name, u32 *size, u64 *mtime);
+bool fileid(const char *name, u64 id[2]);
+bool mapfile(const char *name, u8 **buf, u32 *size);
+void unmapfile(u8 *buf, u32 size);
 
 #endif // _IO_H
@@ -124,6 +124,7 @@ static bool dict_add(jobj_t obj, const char *key, jval_t val)
 	while ((e = obj->indices[i]) < IDX_MAX) {
 		jitem_t item = obj->entries[e];
 		if (IS_ENTRY(item, hash, key)) {
+			free((void*)key); // the item keeps its key
 			free_value((jval_t)item);
 			*(jval_t)item = *val;
 			return true;
@@ -499,7 +500,9 @@ static jobj_t parse_object(ps_t ps)
 
 static inline void check_arr_expand(jarr_t arr)
 {
-	if (arr->size >= arr->cap)
+	if (!arr->data) // empty array
+		arr->data = alloc(arr->data, arr->cap);
+	else if (arr->size >= arr->cap)
 		arr->data = allocr(arr->data, arr->cap <<= 1);
 }
 
@@ -849,7 +852,8 @@ static int buf_catf(buf_t buf, const char *fmt, ...)
 	char b[2048];
 	va_list ap;
 	va_start(ap, fmt);
-	vsnprintf(b, sizeof(buf), fmt, ap);
+	vsnprintf(b, sizeof(b), fmt, ap);
+	va_end(ap);
 	return buf_cat(buf, b);
 }
 
@@ -895,8 +899,9 @@ static void save_key(buf_t buf, const char *s)
 				_ccat(n); goto set_ptr;
 			default:
 				_ccat(n);
-			set_ptr:
+			set_ptr: // buffer may be moved
 				p = buf->buf + buf->size;
+				end = buf->buf + buf->cap;
 		}
 		++s;
 		if (p + 2 > end) {
@@ -965,8 +970,9 @@ static void save_string(buf_t buf, jstr_t s)
 					_catf("\\u%04x", n); goto set_ptr;
 				}
 				break;
-			set_ptr:
+			set_ptr: // buffer may be moved
 				p = buf->buf + buf->size;
+				end = buf->buf + buf->cap;
 		}
 		++s;
 		if (p + 6 > end) {